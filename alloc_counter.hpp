@@ -0,0 +1,209 @@
+// counting heap allocations, and the memory they hold, for benchmarks
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef ALLOC_COUNTER_HPP
+#define ALLOC_COUNTER_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+// Every allocation - operator new, and Eigen's aligned allocations, both end
+// up in malloc - is counted by replacing the allocation functions with ones
+// that count and then forward to glibc's own.  This defines malloc and
+// friends, so include it in exactly one translation unit of a program.
+// Elsewhere AllocationCountingAvailable() is false and the count stays zero.
+// free() is replaced too, so the bytes allocated and not yet freed (as
+// malloc_usable_size reports them) are known, along with their high-water
+// mark.
+//
+// Counting happens only while an AllocationCounter exists; otherwise the
+// wrappers test one flag and forward.  Each thread counts into its own slot,
+// padded to a cache line, so multithreaded code being measured does not
+// contend on shared counters.
+
+int constexpr AllocationSlots = 64;     // threads beyond this share slots
+
+struct alignas(64) AllocationSlot {
+    std::atomic<long> count;
+    std::atomic<long> bytes;            // net, so negative where another thread's blocks are freed
+    std::atomic<long> peak;
+};
+
+inline AllocationSlot *
+AllocationSlotTable() {
+    static AllocationSlot slots[AllocationSlots];   // zero initialized: no allocation, no guard
+    return slots;
+}
+
+// how many AllocationCounters are live; nothing is counted while there are none
+inline std::atomic<int> &
+ActiveAllocationCounters() {
+    static std::atomic<int> active(0);
+    return active;
+}
+
+inline bool
+CountingAllocations() {
+    return ActiveAllocationCounters().load(std::memory_order_relaxed) != 0;
+}
+
+inline AllocationSlot &
+ThreadAllocationSlot() {
+    static std::atomic<int> nextSlot(0);
+    static thread_local int slot = -1;
+    if (slot < 0) {
+        slot = nextSlot.fetch_add(1, std::memory_order_relaxed) % AllocationSlots;
+    }
+    return AllocationSlotTable()[slot];
+}
+
+// account for a block of size bytes coming (or, negative, going)
+inline void
+AddAllocatedBytes(AllocationSlot & slot, long size) {
+    long const now = slot.bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    long peak = slot.peak.load(std::memory_order_relaxed);
+    while ((now > peak) &&
+           !slot.peak.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+    }
+}
+
+#if defined(__GLIBC__)
+
+// a block just allocated (or null)
+inline void *
+CountAllocation(void * p) {
+    if (CountingAllocations()) {
+        AllocationSlot & slot = ThreadAllocationSlot();
+        slot.count.fetch_add(1, std::memory_order_relaxed);
+        if (p) {
+            AddAllocatedBytes(slot, long(malloc_usable_size(p)));
+        }
+    }
+    return p;
+}
+
+// a block about to be freed (or moved by realloc)
+inline void
+CountRelease(void * p) {
+    if (p && CountingAllocations()) {
+        AddAllocatedBytes(ThreadAllocationSlot(), -long(malloc_usable_size(p)));
+    }
+}
+
+extern "C" {
+void * __libc_malloc(std::size_t);
+void * __libc_calloc(std::size_t, std::size_t);
+void * __libc_realloc(void *, std::size_t);
+void * __libc_memalign(std::size_t, std::size_t);
+void   __libc_free(void *);
+
+void * malloc(std::size_t size) {
+    return CountAllocation(__libc_malloc(size));
+}
+
+void * calloc(std::size_t n, std::size_t size) {
+    return CountAllocation(__libc_calloc(n, size));
+}
+
+void * realloc(void * p, std::size_t size) {
+    long const old = (p && CountingAllocations()) ? long(malloc_usable_size(p)) : 0;
+    void * q = __libc_realloc(p, size);
+    if (old && (q || (size == 0))) {
+        AddAllocatedBytes(ThreadAllocationSlot(), -old);    // the old block is gone (moved, or freed for size 0)
+    }
+    return CountAllocation(q);
+}
+
+void * memalign(std::size_t alignment, std::size_t size) {
+    return CountAllocation(__libc_memalign(alignment, size));
+}
+
+void * aligned_alloc(std::size_t alignment, std::size_t size) {
+    return CountAllocation(__libc_memalign(alignment, size));
+}
+
+// as glibc's: the alignment must be a power of two multiple of sizeof(void *),
+// and *p is left alone on failure
+int posix_memalign(void ** p, std::size_t alignment, std::size_t size) {
+    if ((alignment % sizeof(void *) != 0) || ((alignment & (alignment - 1)) != 0)) {
+        return EINVAL;
+    }
+    void * q = CountAllocation(__libc_memalign(alignment, size));
+    if (!q) {
+        return ENOMEM;
+    }
+    *p = q;
+    return 0;
+}
+
+void free(void * p) {
+    CountRelease(p);
+    __libc_free(p);
+}
+}
+
+inline bool AllocationCountingAvailable() { return true; }
+
+#else
+
+inline bool AllocationCountingAvailable() { return false; }
+
+#endif
+
+// Allocations made since construction, and the most memory held at once
+// beyond what was held at construction.  Constructing a counter restarts the
+// high-water mark, so counters whose lifetimes overlap share it.  The peak is
+// tracked per thread and summed, which is exact for one thread and an upper
+// bound when several allocate at once.
+// Blocks are not tagged with when they were allocated, so freeing (or
+// reallocating) one allocated before counting began still subtracts its
+// size: the count then drops below what was held at construction, and the
+// peak is a lower bound.  It is exact when the counted code frees only
+// memory it allocated itself, as a benchmark's timing loop usually does.
+struct AllocationCounter {
+    AllocationCounter() : start_(0), startBytes_(0) {
+        ActiveAllocationCounters().fetch_add(1);
+        for (int i = 0; i < AllocationSlots; ++i) {
+            AllocationSlot & slot = AllocationSlotTable()[i];
+            long const bytes = slot.bytes.load();
+            slot.peak.store(bytes);
+            start_ += slot.count.load();
+            startBytes_ += bytes;
+        }
+    }
+    ~AllocationCounter() {
+        ActiveAllocationCounters().fetch_sub(1);
+    }
+    AllocationCounter(AllocationCounter const &) = delete;
+    AllocationCounter & operator=(AllocationCounter const &) = delete;
+
+    long count() const {
+        long total = 0;
+        for (int i = 0; i < AllocationSlots; ++i) {
+            total += AllocationSlotTable()[i].count.load();
+        }
+        return total - start_;
+    }
+    long peakBytes() const {
+        long total = 0;
+        for (int i = 0; i < AllocationSlots; ++i) {
+            total += AllocationSlotTable()[i].peak.load();
+        }
+        return total - startBytes_;
+    }
+private:
+    long start_;
+    long startBytes_;
+};
+
+#endif // ALLOC_COUNTER_HPP
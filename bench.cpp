@@ -7,7 +7,10 @@
 // with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 #include <cmath>
+#include <cstdio>
 #include <iostream>
+#include <memory>
+#include <type_traits>
 #include <vector>
 #include <Eigen/Core>
 #include <Eigen/SparseCore>
@@ -15,7 +18,18 @@
 
 #include <benchmark/benchmark.h>
 
+#include "alloc_counter.hpp"
+#include "blocked_q.hpp"
+#include "cmdline_options.hpp"
+#include "generate_q.hpp"
+#include "householder_kernels.hpp"
+#include "mixed_precision.hpp"
+#include "parallel_q.hpp"
+#include "qr_stats_counters.hpp"
+#include "qr_update.hpp"
 #include "random_matrix.hpp"
+#include "sparse_rhs_q.hpp"
+#include "streaming_q.hpp"
 
 int main(int argc, char* argv[]) {
     using namespace Eigen;
@@ -23,12 +37,38 @@ int main(int argc, char* argv[]) {
     // process and remove gbench arguments
     benchmark::Initialize(&argc, argv);
 
+    // the parallel benchmarks sweep thread counts in powers of two up to this
+    int const maxThreads = std::stoi(TakeOption(argc, argv, "--threads",
+                                                std::to_string(Eigen::nbThreads())));
+
+    // --seed selects the family of random matrices; --cache=DIR keeps them, and
+    // their factorizations, on disk between runs
+    unsigned const seed = std::stoul(TakeOption(argc, argv, "--seed", "0"));
+    std::string const cacheDir = TakeOption(argc, argv, "--cache", "");
+    // the streaming benchmark's input and output files go in --scratch=DIR
+    std::string const scratchDir = TakeOption(argc, argv, "--scratch", ".");
+
     using Float = float;
 
     // create a random NxN sparse matrix
     using namespace Eigen;
-    std::default_random_engine gen;
-    MatrixCache<Float> matrices;    // cache to ensure we compare same matrices for each size
+    std::default_random_engine gen(seed);
+    MatrixCache<Float> matrices(seed, cacheDir);  // cache to ensure we compare same matrices for each size
+    MatrixCache<double> doubleMatrices(seed, cacheDir);
+
+    // benchmark generating the random input matrices themselves, up to production scale
+    // arguments are the dimension and the expected nonzeros per column
+    benchmark::RegisterBenchmark(
+        "RandomMatrixGeneration",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            float density = (float)(state.range(1)) / size;
+            for (auto _ : state) {
+                SparseMatrix<Float> mat = RandomMatrixOfSize<Float>(gen, size, size, density,
+                                                                    NoEmptyRowsOrCols);
+                benchmark::DoNotOptimize(mat);
+            }
+        })->Ranges({{1<<10, 1<<20}, {2, 8}});
 
     // benchmark creating the Q matrix from the (sparse) Householder vectors
     // via identity multiplication
@@ -36,27 +76,92 @@ int main(int argc, char* argv[]) {
         "GenerateQMatrix",
         [&](benchmark::State & state) {
             Index size = state.range(0);
-            SparseMatrix<Float> mat = matrices.getRandomMatrix(gen, size, size,
-                                                               (float)(state.range(1))/1000.);
-            SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>> qr(mat);
+            auto const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
             auto id_size = qr.matrixQ().rows();   // RHS size for multiply
             Matrix<Float, Dynamic, Dynamic> id =
                 Matrix<Float, Dynamic, Dynamic>::Identity(id_size, id_size);
+            AllocationCounter allocs;
             for (auto _ : state) {
                 Matrix<Float, Dynamic, Dynamic> q =
                     qr.matrixQ() * Matrix<Float, Dynamic, Dynamic>::Identity(id_size, id_size);
                 benchmark::DoNotOptimize(q);
             }
+            state.counters["peakBytes"] = allocs.peakBytes();
+            SetQRCountsCounters(state, QRPhase::QGeneration, QProductCounts(qr, id_size, true));
         })->Ranges({{64, 2000}, {5, 20}});  // second argument is density in tenths of a percent
 
+    // creating a sparse Q directly from the Householder vectors, with no dense intermediate
+    benchmark::RegisterBenchmark(
+        "GenerateSparseQ",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            auto const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            Index nnz = 0;
+            QRStats stats;
+            CollectQRStats collect(stats);
+            AllocationCounter allocs;
+            for (auto _ : state) {
+                SparseMatrix<Float> q = SparseQ(qr.matrixQ());
+                nnz = q.nonZeros();
+                benchmark::DoNotOptimize(q);
+            }
+            SetQRStatsCounters(state, stats);
+            state.counters["nnzQ"] = nnz;
+            state.counters["peakBytes"] = allocs.peakBytes();
+        })->Ranges({{64, 2000}, {5, 20}});
+
+    // thin Q: just the first k columns, via the identity optimization and via ThinQ
+    // arguments are size and k, with density fixed at 0.5%
+    benchmark::RegisterBenchmark(
+        "ThinQ-Identity",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            auto const & qr = matrices.getFactorization(size, size, 0.005);
+            Index k = std::min<Index>(state.range(1), qr.matrixQ().rows());
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q =
+                    qr.matrixQ() * Matrix<Float, Dynamic, Dynamic>::Identity(qr.matrixQ().rows(), k);
+                benchmark::DoNotOptimize(q);
+            }
+            SetQRCountsCounters(state, QRPhase::QGeneration, QProductCounts(qr, k, true));
+        })->Ranges({{512, 2000}, {8, 512}});
+
+    benchmark::RegisterBenchmark(
+        "ThinQ",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            auto const & qr = matrices.getFactorization(size, size, 0.005);
+            Index k = std::min<Index>(state.range(1), qr.matrixQ().rows());
+            QRStats stats;
+            CollectQRStats collect(stats);
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q = ThinQ(qr.matrixQ(), k);
+                benchmark::DoNotOptimize(q);
+            }
+            SetQRStatsCounters(state, stats);
+        })->Ranges({{512, 2000}, {8, 512}});
+
+    benchmark::RegisterBenchmark(
+        "ThinQ-Transpose",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            auto const & qr = matrices.getFactorization(size, size, 0.005);
+            Index k = std::min<Index>(state.range(1), qr.matrixQ().rows());
+            QRStats stats;
+            CollectQRStats collect(stats);
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q = ThinQ(qr.matrixQ().transpose(), k);
+                benchmark::DoNotOptimize(q);
+            }
+            SetQRStatsCounters(state, stats);
+        })->Ranges({{512, 2000}, {8, 512}});
+
     // now try the transposed versions of both
     benchmark::RegisterBenchmark(
         "GenerateQMatrix-Transpose",
         [&](benchmark::State & state) {
             Index size = state.range(0);
-            SparseMatrix<Float> mat = matrices.getRandomMatrix(gen, size, size,
-                                                               (float)(state.range(1))/1000.);
-            SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>> qr(mat);
+            auto const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
             auto id_size = qr.matrixQ().rows();   // RHS size for multiply
             Matrix<Float, Dynamic, Dynamic> id =
                 Matrix<Float, Dynamic, Dynamic>::Identity(id_size, id_size);
@@ -65,6 +170,7 @@ int main(int argc, char* argv[]) {
                     qr.matrixQ().transpose() * Matrix<Float, Dynamic, Dynamic>::Identity(id_size, id_size);
                 benchmark::DoNotOptimize(q);
             }
+            SetQRCountsCounters(state, QRPhase::QGeneration, QProductCounts(qr, id_size, false));
         })->Ranges({{64, 2000}, {5, 20}});
 
     // benchmark multiplying the (implicit) Q matrix times a random dense matrix
@@ -72,9 +178,7 @@ int main(int argc, char* argv[]) {
         "QMatrixProduct",
         [&](benchmark::State & state) {
             Index size = state.range(0);
-            SparseMatrix<Float> mat = matrices.getRandomMatrix(gen, size, size,
-                                                               (float)(state.range(1))/1000.);
-            SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>> qr(mat);
+            auto const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
             auto rhs_size = qr.matrixQ().rows();   // RHS size for multiply
             Matrix<Float, Dynamic, Dynamic> rhs =
                 Matrix<Float, Dynamic, Dynamic>::Random(rhs_size, rhs_size);
@@ -82,15 +186,14 @@ int main(int argc, char* argv[]) {
                 Matrix<Float, Dynamic, Dynamic> q = qr.matrixQ() * rhs;
                 benchmark::DoNotOptimize(q);
             }
+            SetQRCountsCounters(state, QRPhase::QProduct, QProductCounts(qr, rhs.cols(), false));
         })->Ranges({{64, 2000}, {5, 20}});
 
     benchmark::RegisterBenchmark(
         "QMatrixProduct-Transpose",
         [&](benchmark::State & state) {
             Index size = state.range(0);
-            SparseMatrix<Float> mat = matrices.getRandomMatrix(gen, size, size,
-                                                               (float)(state.range(1))/1000.);
-            SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>> qr(mat);
+            auto const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
             auto rhs_size = qr.matrixQ().rows();   // RHS size for multiply
             Matrix<Float, Dynamic, Dynamic> rhs =
                 Matrix<Float, Dynamic, Dynamic>::Random(rhs_size, rhs_size);
@@ -98,8 +201,357 @@ int main(int argc, char* argv[]) {
                 Matrix<Float, Dynamic, Dynamic> q = qr.matrixQ().transpose() * rhs;
                 benchmark::DoNotOptimize(q);
             }
+            SetQRCountsCounters(state, QRPhase::QProduct, QProductCounts(qr, rhs.cols(), false));
+        })->Ranges({{64, 2000}, {5, 20}});
+
+    // products with sparse right hand sides, as in incremental solvers: 16 columns
+    // with about 3 nonzeros each, against the dense product Eigen offers
+    auto sparseRhs = [&](Index rows) {
+        std::default_random_engine rhsGen(seed);
+        return RandomMatrixOfSize<Float>(rhsGen, rows, 16, 3.0f / rows);
+    };
+
+    benchmark::RegisterBenchmark(
+        "QMatrixProduct-SparseRhs",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            auto const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            SparseMatrix<Float> rhs = sparseRhs(qr.rows());
+            SparseRhsHouseholderQ<MatrixCache<Float>::QRType> sparseQ(qr);
+            SparseMatrix<Float> q;
+            for (auto _ : state) {
+                q = sparseQ * rhs;
+                benchmark::DoNotOptimize(q);
+            }
+            state.counters["nnzResult"] = q.nonZeros();
+        })->Ranges({{64, 2000}, {1, 20}});
+
+    benchmark::RegisterBenchmark(
+        "QMatrixProduct-Transpose-SparseRhs",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            auto const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            SparseMatrix<Float> rhs = sparseRhs(qr.rows());
+            SparseRhsHouseholderQ<MatrixCache<Float>::QRType> sparseQ(qr);
+            SparseMatrix<Float> q;
+            for (auto _ : state) {
+                q = sparseQ.transpose() * rhs;
+                benchmark::DoNotOptimize(q);
+            }
+            state.counters["nnzResult"] = q.nonZeros();
+        })->Ranges({{64, 2000}, {1, 20}});
+
+    benchmark::RegisterBenchmark(
+        "QMatrixProduct-SparseRhs-Dense",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            auto const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            Matrix<Float, Dynamic, Dynamic> rhs(sparseRhs(qr.rows()));
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q = qr.matrixQ() * rhs;
+                benchmark::DoNotOptimize(q);
+            }
+            SetQRCountsCounters(state, QRPhase::QProduct, QProductCounts(qr, rhs.cols(), false));
+        })->Ranges({{64, 2000}, {1, 20}});
+
+    // the same products, applying the reflectors in compact WY panels
+    benchmark::RegisterBenchmark(
+        "QMatrixProduct-Blocked",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            using QRType = MatrixCache<Float>::QRType;
+            QRType const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            BlockedHouseholderQ<QRType> blockedQ(qr);
+            auto rhs_size = qr.matrixQ().rows();   // RHS size for multiply
+            Matrix<Float, Dynamic, Dynamic> rhs =
+                Matrix<Float, Dynamic, Dynamic>::Random(rhs_size, rhs_size);
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q = blockedQ * rhs;
+                benchmark::DoNotOptimize(q);
+            }
+        })->Ranges({{64, 2000}, {5, 20}});
+
+    benchmark::RegisterBenchmark(
+        "QMatrixProduct-Transpose-Blocked",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            using QRType = MatrixCache<Float>::QRType;
+            QRType const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            BlockedHouseholderQ<QRType> blockedQ(qr);
+            auto rhs_size = qr.matrixQ().rows();   // RHS size for multiply
+            Matrix<Float, Dynamic, Dynamic> rhs =
+                Matrix<Float, Dynamic, Dynamic>::Random(rhs_size, rhs_size);
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q = blockedQ.transpose() * rhs;
+                benchmark::DoNotOptimize(q);
+            }
         })->Ranges({{64, 2000}, {5, 20}});
 
+    // the column-parallel products, over a range of thread counts
+    // arguments are size, density, and thread count
+    auto threadSweep = [maxThreads](benchmark::internal::Benchmark * b) {
+        b->UseRealTime();
+        for (int size : {64, 512, 2000}) {
+            for (int density : {5, 20}) {
+                for (int threads = 1; threads < maxThreads; threads *= 2) {
+                    b->Args({size, density, threads});
+                }
+                b->Args({size, density, maxThreads});
+            }
+        }
+    };
+
+    threadSweep(benchmark::RegisterBenchmark(
+        "GenerateQMatrix-Parallel",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            using QRType = MatrixCache<Float>::QRType;
+            QRType const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            ParallelHouseholderQ<QRType> parallelQ(qr, state.range(2));
+            auto id_size = qr.matrixQ().rows();   // RHS size for multiply
+            QRStats stats;
+            CollectQRStats collect(stats);
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q =
+                    parallelQ * Matrix<Float, Dynamic, Dynamic>::Identity(id_size, id_size);
+                benchmark::DoNotOptimize(q);
+            }
+            SetQRStatsCounters(state, stats);
+        }));
+
+    threadSweep(benchmark::RegisterBenchmark(
+        "QMatrixProduct-Parallel",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            using QRType = MatrixCache<Float>::QRType;
+            QRType const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            ParallelHouseholderQ<QRType> parallelQ(qr, state.range(2));
+            auto rhs_size = qr.matrixQ().rows();   // RHS size for multiply
+            Matrix<Float, Dynamic, Dynamic> rhs =
+                Matrix<Float, Dynamic, Dynamic>::Random(rhs_size, rhs_size);
+            QRStats stats;
+            CollectQRStats collect(stats);
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q = parallelQ * rhs;
+                benchmark::DoNotOptimize(q);
+            }
+            SetQRStatsCounters(state, stats);
+        }));
+
+    threadSweep(benchmark::RegisterBenchmark(
+        "QMatrixProduct-Transpose-Parallel",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            using QRType = MatrixCache<Float>::QRType;
+            QRType const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            ParallelHouseholderQ<QRType> parallelQ(qr, state.range(2));
+            auto rhs_size = qr.matrixQ().rows();   // RHS size for multiply
+            Matrix<Float, Dynamic, Dynamic> rhs =
+                Matrix<Float, Dynamic, Dynamic>::Random(rhs_size, rhs_size);
+            QRStats stats;
+            CollectQRStats collect(stats);
+            for (auto _ : state) {
+                Matrix<Float, Dynamic, Dynamic> q = parallelQ.transpose() * rhs;
+                benchmark::DoNotOptimize(q);
+            }
+            SetQRStatsCounters(state, stats);
+        }));
+
+    // the reflector kernels at each instruction set this CPU supports (the last
+    // argument, a SimdLevel), on one thread, in both precisions
+    auto kernelBenchmark = [&](char const * name, auto & cache) {
+        using QRType = typename std::decay<decltype(cache)>::type::QRType;
+        using Scalar = typename QRType::Scalar;
+        auto b = benchmark::RegisterBenchmark(
+            name,
+            [&cache](benchmark::State & state) {
+                Index size = state.range(0);
+                QRType const & qr = cache.getFactorization(size, size, (float)(state.range(1))/1000.);
+                ParallelHouseholderQ<QRType> parallelQ(qr, 1);
+                LimitSimdLevel(SimdLevel(state.range(2)));
+                state.SetLabel(SimdLevelName(ActiveSimdLevel()));
+                Matrix<Scalar, Dynamic, Dynamic> rhs =
+                    Matrix<Scalar, Dynamic, Dynamic>::Random(qr.rows(), 64);
+                for (auto _ : state) {
+                    Matrix<Scalar, Dynamic, Dynamic> q = parallelQ * rhs;
+                    benchmark::DoNotOptimize(q);
+                }
+                LimitSimdLevel(SimdLevel::AVX512);
+            });
+        for (long size : {64, 512, 2000}) {
+            for (long density : {5, 20}) {
+                for (int level = 0; level <= int(DetectSimdLevel()); level++) {
+                    b->Args({size, density, level});
+                }
+            }
+        }
+    };
+    kernelBenchmark("QMatrixProduct-Kernels-float", matrices);
+    kernelBenchmark("QMatrixProduct-Kernels-double", doubleMatrices);
+
+    // Q' times a 16384 column matrix streamed from one file to another, within a
+    // memory budget (the last argument, in MB).  Both files are evicted from the
+    // page cache before each pass, so the rate (reads plus writes) is what the
+    // storage under --scratch sustains, or the arithmetic if that is slower
+    benchmark::RegisterBenchmark(
+        "QMatrixProduct-Transpose-Streaming",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            using QRType = MatrixCache<Float>::QRType;
+            QRType const & qr = matrices.getFactorization(size, size, (float)(state.range(1))/1000.);
+            Index const columns = 16384;
+            std::string const inPath = scratchDir + "/streaming-in.bin";
+            std::string const outPath = scratchDir + "/streaming-out.bin";
+            StreamingQ<QRType> streaming(qr, std::size_t(state.range(2)) << 20, maxThreads);
+            {
+                // written in chunks, so the input need never be in memory either
+                DenseFile<Float> in(inPath, qr.rows(), columns);
+                for (Index j = 0; j < columns; j += streaming.chunkColumns()) {
+                    Index const width = std::min(streaming.chunkColumns(), columns - j);
+                    in.cols(j, width).setRandom();
+                    in.release(j, width);
+                }
+            }
+            for (auto _ : state) {
+                state.PauseTiming();
+                DenseFile<Float>(inPath).dropCache();
+                DenseFile<Float> const out(outPath);
+                if (out.valid()) {
+                    out.dropCache();
+                }
+                state.ResumeTiming();
+                if (!streaming.applyTranspose(inPath, outPath)) {
+                    state.SkipWithError("could not stream through the scratch directory");
+                    break;
+                }
+            }
+            state.SetBytesProcessed(state.iterations() * 2 * qr.rows() * columns * sizeof(Float));
+            state.counters["chunkColumns"] = streaming.chunkColumns();
+            std::remove(inPath.c_str());
+            std::remove(outPath.c_str());
+        })->Ranges({{512, 2000}, {5, 5}, {16, 256}})->UseRealTime();
+
+    // time to a double precision least squares solution, factorization included:
+    // a double factorization, versus a float one plus refinement.
+    // Adding the identity makes the random matrices (almost surely) full rank -
+    // a rank deficient one would go straight to the double fallback
+    auto fullRank = [&](Index size, long density) {
+        SparseMatrix<double> id(size, size);
+        id.setIdentity();
+        return SparseMatrix<double>(doubleMatrices.getRandomMatrix(size, size, (float)(density)/1000.) + id);
+    };
+    benchmark::RegisterBenchmark(
+        "Solve-Double",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            SparseMatrix<double> const mat = fullRank(size, state.range(1));
+            VectorXd b = VectorXd::Random(size);
+            for (auto _ : state) {
+                SparseQR<SparseMatrix<double>, COLAMDOrdering<int>> qr(mat);
+                VectorXd x = qr.solve(b);
+                benchmark::DoNotOptimize(x);
+            }
+        })->Ranges({{64, 2000}, {5, 20}});
+
+    benchmark::RegisterBenchmark(
+        "Solve-MixedPrecision",
+        [&](benchmark::State & state) {
+            Index size = state.range(0);
+            SparseMatrix<double> const mat = fullRank(size, state.range(1));
+            VectorXd b = VectorXd::Random(size);
+            int steps = 0;
+            bool fellBack = false;
+            for (auto _ : state) {
+                MixedPrecisionQR<> qr(mat);
+                VectorXd x = qr.solve(b);
+                benchmark::DoNotOptimize(x);
+                steps = qr.iterations();
+                fellBack = qr.usesDoubleFactorization();
+            }
+            state.counters["steps"] = steps;
+            state.counters["fallback"] = fellBack;
+        })->Ranges({{64, 2000}, {5, 20}});
+
+    // a sliding window least squares problem: each tick appends one row and drops the
+    // oldest, by updating the factorization, updating it but refactoring whenever
+    // QRUpdate advises, or refactoring the window every tick.  The arguments are the
+    // window size in rows, over 128 columns, and the number of ticks run from a fresh
+    // factorization; updates accumulate rotations in Q, so their cost per tick
+    // (the inverse of items_per_second) grows with the tick count
+    Index const windowCols = 128;
+    auto windowRows = [&](Index window, Index ticks) {
+        return SparseMatrix<double, RowMajor>(
+            doubleMatrices.getRandomMatrix(window + ticks, windowCols, 0.05f));
+    };
+    auto windowArgs = [](benchmark::internal::Benchmark * b) {
+        for (long window : {256, 1024, 4096}) {
+            for (long ticks : {16, 64, 256}) {
+                b->Args({window, ticks});
+            }
+        }
+    };
+    using WindowQRType = SparseQR<SparseMatrix<double>, COLAMDOrdering<int>>;
+    auto slidingUpdate = [&](benchmark::State & state, bool refactor) {
+        Index const window = state.range(0);
+        Index const ticks = state.range(1);
+        SparseMatrix<double, RowMajor> const stream = windowRows(window, ticks);
+        WindowQRType qr;
+        std::unique_ptr<QRUpdate<WindowQRType>> update;
+        std::size_t rotations = 0;
+        int refactors = 0;
+        for (auto _ : state) {
+            state.PauseTiming();
+            qr.compute(SparseMatrix<double>(stream.topRows(window)));
+            update.reset(new QRUpdate<WindowQRType>(qr));
+            state.ResumeTiming();
+            for (Index next = window; next < window + ticks; next++) {
+                update->appendRow(stream.row(next));
+                if (!update->removeRow(update->rowIds()[0])) {
+                    state.SkipWithError("a window row could not be removed");
+                    return;
+                }
+                if (refactor && update->refactorAdvised()) {
+                    update.reset();
+                    qr.compute(SparseMatrix<double>(stream.middleRows(next + 1 - window, window)));
+                    update.reset(new QRUpdate<WindowQRType>(qr));
+                    refactors++;
+                }
+            }
+            rotations = update->rotations();
+        }
+        state.SetItemsProcessed(state.iterations() * ticks);
+        state.counters["rotations"] = double(rotations);
+        if (refactor) {
+            state.counters["refactors"] = benchmark::Counter(double(refactors), benchmark::Counter::kAvgIterations);
+        }
+    };
+
+    benchmark::RegisterBenchmark(
+        "SlidingWindow-Update",
+        [&](benchmark::State & state) { slidingUpdate(state, false); })->Apply(windowArgs);
+
+    benchmark::RegisterBenchmark(
+        "SlidingWindow-Update-Refactoring",
+        [&](benchmark::State & state) { slidingUpdate(state, true); })->Apply(windowArgs);
+
+    benchmark::RegisterBenchmark(
+        "SlidingWindow-Refactor",
+        [&](benchmark::State & state) {
+            Index const window = state.range(0);
+            Index const ticks = state.range(1);
+            SparseMatrix<double, RowMajor> const stream = windowRows(window, ticks);
+            WindowQRType qr;
+            for (auto _ : state) {
+                for (Index next = 1; next <= ticks; next++) {
+                    state.PauseTiming();
+                    SparseMatrix<double> mat = stream.middleRows(next, window);
+                    state.ResumeTiming();
+                    qr.compute(mat);
+                }
+            }
+            state.SetItemsProcessed(state.iterations() * ticks);
+        })->Apply(windowArgs);
+
     benchmark::RunSpecifiedBenchmarks();
 
 }
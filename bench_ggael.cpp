@@ -7,54 +7,236 @@
 // Public License v. 2.0. If a copy of the MPL was not distributed
 // with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+#include <chrono>
 #include <cmath>
 #include <iostream>
+#include <memory>
+#include <thread>
 #include <vector>
 #include <Eigen/Core>
 #include <Eigen/SparseCore>
 #include <Eigen/SparseQR>
-#include <unsupported/Eigen/SparseExtra>
 
 #include <benchmark/benchmark.h>
 
+#include "alloc_counter.hpp"
+#include "blocked_q.hpp"
+#include "cmdline_options.hpp"
+#include "market_loader.hpp"
+#include "mixed_precision.hpp"
+#include "parallel_factorize.hpp"
+#include "parallel_q.hpp"
+#include "q_workspace.hpp"
+#include "qr_pattern.hpp"
+#include "qr_stats_counters.hpp"
+
 int main(int argc, char* argv[]) {
     using namespace Eigen;
 
     // process and remove gbench arguments
     benchmark::Initialize(&argc, argv);
 
-    if (argc < 1) {
+    // the parallel benchmarks sweep thread counts in powers of two up to this
+    int const maxThreads = std::stoi(TakeOption(argc, argv, "--threads",
+                                                std::to_string(Eigen::nbThreads())));
+
+    // --sidecar=1 keeps a binary copy of the input beside it (input.mtx.bin), and
+    // loads from that on later runs
+    bool const sidecar = std::stoi(TakeOption(argc, argv, "--sidecar", "0")) != 0;
+
+    if (argc < 2) {
         std::cerr << "please supply a MatrixMarket input file\n";
         return 1;
     }
 
     using Float = double;
     SparseMatrix<Float> sA;
-    SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>> qr;
+    InstrumentedQR<SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>>> qr;
 
-    loadMarket( sA, argv[1] );
+    auto loadStart = std::chrono::steady_clock::now();
+    if (!LoadMarketFast(sA, argv[1], std::thread::hardware_concurrency(), sidecar)) {
+        std::cerr << "could not load MatrixMarket file " << argv[1] << "\n";
+        return 1;
+    }
+    std::cerr << "loaded " << sA.rows() << "x" << sA.cols() << " with " << sA.nonZeros()
+              << " nonzeros in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - loadStart).count()
+              << "s\n";
+
+    // heap allocations per iteration, counted over the whole timing loop
+    auto reportAllocations = [](benchmark::State & state, AllocationCounter const & allocs) {
+        if (AllocationCountingAvailable()) {
+            state.counters["allocs"] = benchmark::Counter(double(allocs.count()),
+                                                          benchmark::Counter::kAvgIterations);
+        }
+    };
 
     // benchmark things a la ggael
     benchmark::RegisterBenchmark(
         "QR facto",
         [&](benchmark::State & state) {
+            qr.stats().reset();
             for (auto _ : state) {
                 qr.compute(sA);
             }
+            AddIterationCounts(state, qr.stats(), QRPhase::Factorization, qr.factorizationCounts());
+            SetQRStatsCounters(state, qr.stats());
+        });
+
+    // the same work split into its symbolic and numeric parts, as when refactoring
+    // many matrices that share one pattern
+    using QRType = SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>>;
+    QRSymbolic<QRType> symbolic;
+    {
+        QRType analyzed;
+        symbolic = AnalyzeQR(analyzed, sA);
+    }
+
+    benchmark::RegisterBenchmark(
+        "QR analyze",
+        [&](benchmark::State & state) {
+            for (auto _ : state) {
+                QRType analyzed;
+                analyzed.analyzePattern(sA);
+            }
         });
 
+    benchmark::RegisterBenchmark(
+        "QR analyze predicted",
+        [&](benchmark::State & state) {
+            for (auto _ : state) {
+                QRType analyzed;
+                benchmark::DoNotOptimize(AnalyzeQR(analyzed, sA));
+            }
+        });
+
+    // a first factorization after Eigen's analysis, which grows the factors as it goes
+    benchmark::RegisterBenchmark(
+        "QR factorize",
+        [&](benchmark::State & state) {
+            std::unique_ptr<QRType> fresh;
+            for (auto _ : state) {
+                state.PauseTiming();
+                fresh.reset(new QRType);
+                fresh->analyzePattern(sA);
+                state.ResumeTiming();
+                fresh->factorize(sA);
+            }
+        });
+
+    // a first factorization with the cached analysis and exactly reserved factors
+    benchmark::RegisterBenchmark(
+        "QR factorize reserved",
+        [&](benchmark::State & state) {
+            std::unique_ptr<QRType> fresh;
+            for (auto _ : state) {
+                state.PauseTiming();
+                fresh.reset(new QRType);
+                ReuseAnalysis(*fresh, symbolic);
+                state.ResumeTiming();
+                fresh->factorize(sA);
+            }
+        });
+
+    // steady state: one object refactoring same-pattern matrices
+    benchmark::RegisterBenchmark(
+        "QR factorize reuse",
+        [&](benchmark::State & state) {
+            InstrumentedQR<QRType> reused;
+            ReuseAnalysis<QRType>(reused, symbolic);
+            AllocationCounter allocs;
+            for (auto _ : state) {
+                reused.factorize(sA);
+            }
+            reportAllocations(state, allocs);
+            AddIterationCounts(state, reused.stats(), QRPhase::Factorization, reused.factorizationCounts());
+            SetQRStatsCounters(state, reused.stats());
+            state.counters["nnzR"] = reused.matrixR().nonZeros();
+            state.counters["nnzQ"] = HouseholderVectors(reused).nonZeros();
+        });
+
+    // the same factorization, in parallel over the column elimination tree
+    // the argument is the thread count
+    benchmark::RegisterBenchmark(
+        "QR factorize parallel",
+        [&](benchmark::State & state) {
+            QRType parallel;
+            ReuseAnalysis(parallel, symbolic);
+            bool usedParallel = false;
+            for (auto _ : state) {
+                usedParallel = ParallelFactorize(parallel, sA, int(state.range(0)));
+            }
+            state.counters["parallel"] = usedParallel;
+        })->RangeMultiplier(2)->Range(1, maxThreads)->UseRealTime();
+
     VectorXd b = sA * VectorXd::Random(sA.cols());
 
     benchmark::RegisterBenchmark(
         "QR solve",
         [&](benchmark::State & state) {
             VectorXd x1;
+            AllocationCounter allocs;
             for (auto _ : state) {
                 x1 = qr.solve(b);
                 benchmark::DoNotOptimize(x1);
             }
+            reportAllocations(state, allocs);
         });
 
+    // the same solve into preallocated storage
+    benchmark::RegisterBenchmark(
+        "QR solve workspace",
+        [&](benchmark::State & state) {
+            VectorXd x1(sA.cols());
+            QWorkspace<decltype(qr)> workspace(qr);
+            workspace.solve(b, x1);     // warm up
+            AllocationCounter allocs;
+            for (auto _ : state) {
+                workspace.solve(b, x1);
+                benchmark::DoNotOptimize(x1);
+            }
+            reportAllocations(state, allocs);
+        });
+
+    // time to solution including the factorization, in double and in float with
+    // double refinement.  The argument picks the right hand side: 0 for b, in the
+    // range of A, and 1 for b plus noise of the same size, an inconsistent least
+    // squares problem whose residual refinement must also recover (where sA is
+    // square, the two are alike).  "fallbacks" is the fraction of solves that had
+    // to refactor in double
+    VectorXd const noisy = b + b.norm() / std::sqrt(double(sA.rows())) * VectorXd::Random(sA.rows());
+    auto solveRhs = [&](benchmark::State & state) -> VectorXd const & {
+        return state.range(0) ? noisy : b;
+    };
+
+    benchmark::RegisterBenchmark(
+        "QR facto+solve",
+        [&](benchmark::State & state) {
+            VectorXd const & rhs = solveRhs(state);
+            for (auto _ : state) {
+                QRType fresh(sA);
+                VectorXd x1 = fresh.solve(rhs);
+                benchmark::DoNotOptimize(x1);
+            }
+        })->Arg(0)->Arg(1);
+
+    benchmark::RegisterBenchmark(
+        "QR facto+solve mixed precision",
+        [&](benchmark::State & state) {
+            VectorXd const & rhs = solveRhs(state);
+            int steps = 0;
+            int fallbacks = 0;
+            for (auto _ : state) {
+                MixedPrecisionQR<> mixed(sA);
+                VectorXd x1 = mixed.solve(rhs);
+                benchmark::DoNotOptimize(x1);
+                steps = mixed.iterations();
+                fallbacks += mixed.usesDoubleFactorization();
+            }
+            state.counters["steps"] = steps;
+            state.counters["fallbacks"] = benchmark::Counter(fallbacks, benchmark::Counter::kAvgIterations);
+        })->Arg(0)->Arg(1);
+
     benchmark::RegisterBenchmark(
         "Dense Q",
         [&](benchmark::State & state) {
@@ -63,16 +245,46 @@ int main(int argc, char* argv[]) {
                 Q_dense = qr.matrixQ() * MatrixXd::Identity(sA.rows(),sA.rows());
                 benchmark::DoNotOptimize(Q_dense);
             }
+            SetQRCountsCounters(state, QRPhase::QGeneration, QProductCounts(qr, sA.rows(), true));
         });
 
     benchmark::RegisterBenchmark(
         "Q*b",
         [&](benchmark::State & state) {
             VectorXd z(sA.rows());
+            AllocationCounter allocs;
             for (auto _ : state) {
                 z = qr.matrixQ() * b;
                 benchmark::DoNotOptimize(z);
             }
+            reportAllocations(state, allocs);
+            SetQRCountsCounters(state, QRPhase::QProduct, QProductCounts(qr, 1, false));
+        });
+
+    benchmark::RegisterBenchmark(
+        "Q*b workspace",
+        [&](benchmark::State & state) {
+            VectorXd z(sA.rows());
+            QWorkspace<decltype(qr)> workspace(qr);
+            AllocationCounter allocs;
+            for (auto _ : state) {
+                workspace.applyQ(b, z);
+                benchmark::DoNotOptimize(z);
+            }
+            reportAllocations(state, allocs);
+        });
+
+    benchmark::RegisterBenchmark(
+        "Q'*b workspace",
+        [&](benchmark::State & state) {
+            VectorXd z(sA.rows());
+            QWorkspace<decltype(qr)> workspace(qr);
+            AllocationCounter allocs;
+            for (auto _ : state) {
+                workspace.applyQt(b, z);
+                benchmark::DoNotOptimize(z);
+            }
+            reportAllocations(state, allocs);
         });
 
     benchmark::RegisterBenchmark(
@@ -85,8 +297,49 @@ int main(int argc, char* argv[]) {
                 Z = qr.matrixQ() * B;
                 benchmark::DoNotOptimize(Z);
             }
+            SetQRCountsCounters(state, QRPhase::QProduct, QProductCounts(qr, depth, false));
         })->RangeMultiplier(2)->Range(5, 1000);    // "depth"
 
+    // Q*B_ again, with the reflectors applied in compact WY panels
+    benchmark::RegisterBenchmark(
+        "Q*B_ blocked",
+        [&](benchmark::State & state) {
+            Index depth = state.range(0);
+            MatrixXd Z(sA.rows(),depth), B(sA.rows(),depth);
+            B.setRandom();
+            BlockedHouseholderQ<decltype(qr)> blockedQ(qr);
+            for (auto _ : state) {
+                Z = blockedQ * B;
+                benchmark::DoNotOptimize(Z);
+            }
+        })->RangeMultiplier(2)->Range(5, 1000);    // "depth"
+
+    // thread scaling for dense Q generation and Q*B_
+    // the last argument is the thread count
+    benchmark::RegisterBenchmark(
+        "Dense Q parallel",
+        [&](benchmark::State & state) {
+            MatrixXd Q_dense;
+            ParallelHouseholderQ<decltype(qr)> parallelQ(qr, state.range(0));
+            for (auto _ : state) {
+                Q_dense = parallelQ * MatrixXd::Identity(sA.rows(),sA.rows());
+                benchmark::DoNotOptimize(Q_dense);
+            }
+        })->RangeMultiplier(2)->Range(1, maxThreads)->UseRealTime();
+
+    benchmark::RegisterBenchmark(
+        "Q*B_ parallel",
+        [&](benchmark::State & state) {
+            Index depth = state.range(0);
+            MatrixXd Z(sA.rows(),depth), B(sA.rows(),depth);
+            B.setRandom();
+            ParallelHouseholderQ<decltype(qr)> parallelQ(qr, state.range(1));
+            for (auto _ : state) {
+                Z = parallelQ * B;
+                benchmark::DoNotOptimize(Z);
+            }
+        })->RangeMultiplier(2)->Ranges({{5, 1000}, {1, maxThreads}})->UseRealTime();
+
 
     benchmark::RunSpecifiedBenchmarks();
 
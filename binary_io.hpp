@@ -0,0 +1,332 @@
+// compact binary storage for sparse matrices and factorizations, memory-mapped on load
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef BINARY_IO_HPP
+#define BINARY_IO_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "sparse_qr_access.hpp"
+
+// A file mapped read-only into memory for the lifetime of the object.
+// valid() is false if the file could not be opened or mapped.
+struct MappedFile {
+    explicit MappedFile(std::string const & path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if ((::fstat(fd, &st) == 0) && (st.st_size > 0)) {
+            void * addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                data_ = static_cast<char const *>(addr);
+                size_ = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+
+    MappedFile(MappedFile const &) = delete;
+    MappedFile & operator=(MappedFile const &) = delete;
+
+    ~MappedFile() {
+        if (data_) {
+            ::munmap(const_cast<char *>(data_), size_);
+        }
+    }
+
+    bool valid() const { return data_ != nullptr; }
+    char const * data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+private:
+    char const * data_ = nullptr;
+    std::size_t  size_ = 0;
+};
+
+// Each array is padded to a multiple of 8 bytes so everything in a mapped
+// file stays naturally aligned
+inline std::size_t
+PaddedSize(std::size_t bytes) {
+    return (bytes + 7) & ~std::size_t(7);
+}
+
+// Sequential reads from a mapped file, checking bounds as we go
+struct BinaryReader {
+    BinaryReader(char const * data, std::size_t size) : pos_(data), end_(data + size) {}
+
+    bool ok() const { return ok_; }
+
+    // a pointer to the next n objects of type T, or nullptr if the file is too short
+    template<typename T>
+    T const * take(std::size_t n) {
+        std::size_t const remaining = std::size_t(end_ - pos_);
+        if (n > remaining / sizeof(T)) {   // also keeps the byte count from overflowing
+            ok_ = false;
+            return nullptr;
+        }
+        std::size_t bytes = PaddedSize(n * sizeof(T));
+        if (!ok_ || (remaining < bytes)) {
+            ok_ = false;
+            return nullptr;
+        }
+        T const * result = reinterpret_cast<T const *>(pos_);
+        pos_ += bytes;
+        return result;
+    }
+
+    template<typename T>
+    T read() {
+        T const * p = take<T>(1);
+        T result{};
+        if (p) {
+            std::memcpy(&result, p, sizeof(T));
+        }
+        return result;
+    }
+
+private:
+    char const * pos_;
+    char const * end_;
+    bool         ok_ = true;
+};
+
+// Every file starts with a magic string, a format version, and the scalar and
+// index sizes, so stale or foreign files are rejected rather than misread.
+struct BinaryHeader {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t scalarSize;
+    std::uint32_t indexSize;
+    std::uint32_t reserved;
+};
+
+template<typename Scalar, typename StorageIndex>
+BinaryHeader
+MakeBinaryHeader(char const * magic) {
+    BinaryHeader header{};
+    std::memcpy(header.magic, magic, (std::min)(std::strlen(magic), sizeof(header.magic)));
+    header.version = 1;
+    header.scalarSize = sizeof(Scalar);
+    header.indexSize = sizeof(StorageIndex);
+    return header;
+}
+
+template<typename Scalar, typename StorageIndex>
+bool
+ReadBinaryHeader(BinaryReader & in, char const * magic) {
+    BinaryHeader expected = MakeBinaryHeader<Scalar, StorageIndex>(magic);
+    BinaryHeader header = in.read<BinaryHeader>();
+    return in.ok() && (std::memcmp(&header, &expected, sizeof(header)) == 0);
+}
+
+template<typename T>
+void
+WriteRaw(std::ostream & out, T const * data, std::size_t n) {
+    static char const zeros[8] = {};
+    out.write(reinterpret_cast<char const *>(data), n * sizeof(T));
+    out.write(zeros, PaddedSize(n * sizeof(T)) - n * sizeof(T));
+}
+
+// a compressed sparse matrix: dimensions, nonzero count, then the three arrays
+template<typename Scalar, int Options, typename StorageIndex>
+void
+WriteSparse(std::ostream & out, Eigen::SparseMatrix<Scalar, Options, StorageIndex> const & mat) {
+    eigen_assert(mat.isCompressed() && "only compressed matrices can be written");
+    std::int64_t dims[3] = {mat.rows(), mat.cols(), mat.nonZeros()};
+    WriteRaw(out, dims, 3);
+    WriteRaw(out, mat.outerIndexPtr(), mat.outerSize() + 1);
+    WriteRaw(out, mat.innerIndexPtr(), mat.nonZeros());
+    WriteRaw(out, mat.valuePtr(), mat.nonZeros());
+}
+
+// Everything read is checked before use - dimensions, nonzero count, and
+// every index against them - so a truncated, stale or corrupt file is
+// rejected instead of producing a matrix that indexes out of bounds
+template<typename Scalar, int Options, typename StorageIndex>
+bool
+ReadSparse(BinaryReader & in, Eigen::SparseMatrix<Scalar, Options, StorageIndex> & mat) {
+    using namespace Eigen;
+    std::int64_t const * dims = in.take<std::int64_t>(3);
+    std::int64_t const maxIndex = std::numeric_limits<StorageIndex>::max();
+    if (!dims ||
+        (dims[0] < 0) || (dims[1] < 0) || (dims[2] < 0) ||
+        (dims[0] > maxIndex) || (dims[1] > maxIndex) || (dims[2] > maxIndex)) {
+        return false;
+    }
+    Index const outerSize = (Options & RowMajor) ? dims[0] : dims[1];
+    Index const innerSize = (Options & RowMajor) ? dims[1] : dims[0];
+    StorageIndex const * outer = in.take<StorageIndex>(outerSize + 1);
+    StorageIndex const * inner = in.take<StorageIndex>(dims[2]);
+    Scalar const * values      = in.take<Scalar>(dims[2]);
+    if (!in.ok() || (outer[0] != 0) || (outer[outerSize] != dims[2])) {
+        return false;
+    }
+    for (Index j = 0; j < outerSize; j++) {
+        if (outer[j + 1] < outer[j]) {
+            return false;
+        }
+    }
+    for (std::int64_t k = 0; k < dims[2]; k++) {
+        if ((inner[k] < 0) || (inner[k] >= innerSize)) {
+            return false;
+        }
+    }
+    // copied verbatim: inner indices need not be sorted (SparseQR's Householder
+    // vectors are not), so we cannot assign through a Map
+    mat.resize(dims[0], dims[1]);
+    mat.resizeNonZeros(dims[2]);
+    std::copy(outer, outer + outerSize + 1, mat.outerIndexPtr());
+    std::copy(inner, inner + dims[2], mat.innerIndexPtr());
+    std::copy(values, values + dims[2], mat.valuePtr());
+    return true;
+}
+
+// A hash of a compressed matrix's dimensions and arrays (64 bit FNV-1a), so
+// data derived from it can be tied to exactly this matrix
+template<typename Scalar, int Options, typename StorageIndex>
+std::uint64_t
+SparseFingerprint(Eigen::SparseMatrix<Scalar, Options, StorageIndex> const & mat) {
+    eigen_assert(mat.isCompressed() && "only compressed matrices can be fingerprinted");
+    std::uint64_t hash = 14695981039346656037ull;
+    auto add = [&](void const * data, std::size_t bytes) {
+        unsigned char const * p = static_cast<unsigned char const *>(data);
+        for (std::size_t i = 0; i < bytes; i++) {
+            hash = (hash ^ p[i]) * 1099511628211ull;
+        }
+    };
+    std::int64_t dims[3] = {mat.rows(), mat.cols(), mat.nonZeros()};
+    add(dims, sizeof(dims));
+    add(mat.outerIndexPtr(), (mat.outerSize() + 1) * sizeof(StorageIndex));
+    add(mat.innerIndexPtr(), mat.nonZeros() * sizeof(StorageIndex));
+    add(mat.valuePtr(), mat.nonZeros() * sizeof(Scalar));
+    return hash;
+}
+
+template<typename Derived>
+void
+WriteDense(std::ostream & out, Eigen::PlainObjectBase<Derived> const & mat) {
+    std::int64_t dims[2] = {mat.rows(), mat.cols()};
+    WriteRaw(out, dims, 2);
+    WriteRaw(out, mat.data(), mat.size());
+}
+
+template<typename Derived>
+bool
+ReadDense(BinaryReader & in, Eigen::PlainObjectBase<Derived> & mat) {
+    using Scalar = typename Derived::Scalar;
+    std::int64_t const * dims = in.take<std::int64_t>(2);
+    if (!dims || (dims[0] < 0) || (dims[1] < 0) ||
+        ((dims[1] > 0) && (dims[0] > std::numeric_limits<std::int64_t>::max() / dims[1]))) {
+        return false;
+    }
+    Scalar const * data = in.take<Scalar>(dims[0] * dims[1]);
+    if (!data) {
+        return false;
+    }
+    mat.resize(dims[0], dims[1]);
+    std::copy(data, data + dims[0] * dims[1], mat.data());
+    return true;
+}
+
+// whether indices holds each of 0 .. n-1 exactly once
+template<typename IndicesType>
+bool
+IsPermutation(IndicesType const & indices, std::int64_t n) {
+    if (indices.size() != n) {
+        return false;
+    }
+    std::vector<bool> seen(n, false);
+    for (Eigen::Index i = 0; i < indices.size(); i++) {
+        if ((indices(i) < 0) || (indices(i) >= n) || seen[indices(i)]) {
+            return false;
+        }
+        seen[indices(i)] = true;
+    }
+    return true;
+}
+
+// A SparseQR factorization: R, the Householder vectors and coefficients, and
+// the permutations
+template<typename SparseQRType>
+void
+WriteFactorization(std::ostream & out, SparseQRType const & qr) {
+    using Access = SparseQRAccess<SparseQRType>;
+    std::int64_t dims[3] = {qr.rows(), qr.cols(), qr.rank()};
+    WriteRaw(out, dims, 3);
+    WriteSparse(out, qr.matrixR());
+    WriteSparse(out, Access::householderVectors(qr));
+    WriteDense(out, Access::householderCoeffs(qr));
+    WriteDense(out, Access::fillPermutation(qr).indices());
+    WriteDense(out, qr.colsPermutation().indices());
+}
+
+template<typename SparseQRType>
+bool
+ReadFactorization(BinaryReader & in, SparseQRType & qr) {
+    using Access = SparseQRAccess<SparseQRType>;
+    std::int64_t const * dims = in.take<std::int64_t>(3);
+    typename SparseQRType::QRMatrixType R, Q;
+    typename SparseQRType::ScalarVector hcoeffs;
+    typename SparseQRType::PermutationType fillPerm, outputPerm;
+    if (!dims ||
+        !ReadSparse(in, R) || !ReadSparse(in, Q) || !ReadDense(in, hcoeffs) ||
+        !ReadDense(in, fillPerm.indices()) || !ReadDense(in, outputPerm.indices())) {
+        return false;
+    }
+    // the pieces must agree with each other, and the permutations be permutations
+    std::int64_t const m = dims[0], n = dims[1];
+    if ((dims[2] < 0) || (dims[2] > (std::min)(m, n)) ||
+        (R.rows() != m) || (R.cols() != n) ||
+        (Q.rows() != m) || (Q.cols() != (std::min)(m, n)) || (hcoeffs.size() != (std::min)(m, n)) ||
+        !IsPermutation(fillPerm.indices(), n) || !IsPermutation(outputPerm.indices(), n)) {
+        return false;
+    }
+    Access::restore(qr, dims[0], dims[1], std::move(R), std::move(Q), std::move(hcoeffs),
+                    std::move(fillPerm), std::move(outputPerm), dims[2]);
+    return true;
+}
+
+// Write through a temporary file and rename it into place, so a concurrent
+// reader never sees a partial file
+template<typename Writer>
+bool
+WriteFileAtomically(std::string const & path, Writer && writer) {
+    std::string const tmp = path + ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out) {
+            return false;
+        }
+        writer(out);
+        if (!out) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+#endif // BINARY_IO_HPP
@@ -0,0 +1,216 @@
+// blocked (compact WY) application of the sparse QR Householder sequence
+//
+// Copyright (C) 2017 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef BLOCKED_Q_HPP
+#define BLOCKED_Q_HPP
+
+#include <algorithm>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "sparse_qr_access.hpp"
+
+// Applying reflectors one at a time is a sequence of sparse dot/axpy pairs,
+// which is memory bound for wide right hand sides.  Here we group consecutive
+// reflectors into panels and represent each panel as I - V T V^*, where V is
+// the panel's Householder vectors restricted (as a dense matrix) to the union
+// of their row patterns and T is the small upper triangular factor from the
+// compact WY representation (Schreiber and van Loan, or Golub and van Loan,
+// 4th Ed. section 5.1.7).  Each panel is then applied with three dense
+// level 3 products on just those rows of the operand.
+
+template<typename SparseQRType, typename Derived> struct BlockedQProduct;
+
+namespace Eigen {
+namespace internal {
+
+template<typename SparseQRType, typename Derived>
+struct traits<BlockedQProduct<SparseQRType, Derived>> {
+    typedef typename Derived::PlainObject ReturnType;
+};
+
+} // namespace internal
+} // namespace Eigen
+
+template<typename SparseQRType>
+struct BlockedHouseholderQ {
+    using Scalar       = typename SparseQRType::Scalar;
+    using RealScalar   = typename SparseQRType::RealScalar;
+    using StorageIndex = typename SparseQRType::StorageIndex;
+    using DenseMatrix  = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>;
+
+    // one group of consecutive reflectors
+    struct Panel {
+        std::vector<StorageIndex> rows;  // union of the reflectors' row patterns
+        DenseMatrix V;                   // rows.size() x panel width
+        DenseMatrix T;                   // panel width square, upper triangular
+    };
+
+    // Reflectors are added to a panel until it reaches maxPanelSize, or until
+    // its dense V would have less than minDensity of its entries nonzero;
+    // beyond that point the extra flops outweigh the level 3 speedup.
+    explicit BlockedHouseholderQ(SparseQRType const & qr,
+                                 Eigen::Index maxPanelSize = 32,
+                                 RealScalar minDensity = RealScalar(0.25))
+        : rows_(qr.rows()) {
+        using namespace Eigen;
+        auto const & vecs   = HouseholderVectors(qr);
+        auto const & hcoeff = HouseholderCoeffs(qr);
+        Index const diagSize = (std::min)(qr.rows(), qr.cols());
+
+        std::vector<Index> local(rows_, -1);   // row -> position within current panel
+        Index k = 0;
+        while (k < diagSize) {
+            // greedily choose the reflectors for this panel
+            Panel panel;
+            Index nnz = 0;
+            Index kend = k;
+            while ((kend < diagSize) && ((kend - k) < maxPanelSize)) {
+                Index added = 0;
+                for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs, kend); it; ++it) {
+                    if (local[it.row()] < 0) {
+                        added++;
+                    }
+                }
+                Index colnnz = vecs.outerIndexPtr()[kend+1] - vecs.outerIndexPtr()[kend];
+                Index support = static_cast<Index>(panel.rows.size()) + added;
+                if ((kend > k) &&
+                    (RealScalar(nnz + colnnz) < minDensity * RealScalar(support * (kend - k + 1)))) {
+                    break;    // too sparse to be worth blocking further
+                }
+                for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs, kend); it; ++it) {
+                    if (local[it.row()] < 0) {
+                        local[it.row()] = panel.rows.size();
+                        panel.rows.push_back(StorageIndex(it.row()));
+                    }
+                }
+                nnz += colnnz;
+                kend++;
+            }
+
+            // gather the vectors into dense form
+            Index const width = kend - k;
+            panel.V = DenseMatrix::Zero(panel.rows.size(), width);
+            for (Index j = 0; j < width; j++) {
+                for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs, k + j); it; ++it) {
+                    panel.V(local[it.row()], j) = it.value();
+                }
+            }
+
+            // form T such that H_k ... H_{kend-1} = I - V T V^*, where the
+            // reflectors making up Q are H_j = I - conj(hcoeff(j)) v_j v_j^*
+            DenseMatrix G = panel.V.adjoint() * panel.V;
+            panel.T = DenseMatrix::Zero(width, width);
+            for (Index j = 0; j < width; j++) {
+                Scalar tau = numext::conj(hcoeff(k + j));
+                panel.T(j, j) = tau;
+                if (j > 0) {
+                    Matrix<Scalar, Dynamic, 1> t =
+                        panel.T.topLeftCorner(j, j).template triangularView<Upper>() * G.col(j).head(j);
+                    panel.T.col(j).head(j) = -tau * t;
+                }
+            }
+
+            for (auto r : panel.rows) {
+                local[r] = -1;
+            }
+            panels_.push_back(std::move(panel));
+            k = kend;
+        }
+    }
+
+    template<typename Derived>
+    BlockedQProduct<SparseQRType, Derived>
+    operator*(Eigen::MatrixBase<Derived> const & other) const {
+        return BlockedQProduct<SparseQRType, Derived>(*this, other.derived(), false);
+    }
+
+    // this is the adjoint, like SparseQR's matrixQ().transpose()
+    struct Transpose {
+        explicit Transpose(BlockedHouseholderQ const & q) : q_(q) {}
+
+        template<typename Derived>
+        BlockedQProduct<SparseQRType, Derived>
+        operator*(Eigen::MatrixBase<Derived> const & other) const {
+            return BlockedQProduct<SparseQRType, Derived>(q_, other.derived(), true);
+        }
+    private:
+        BlockedHouseholderQ const & q_;
+    };
+
+    Transpose transpose() const { return Transpose(*this); }
+    Transpose adjoint() const { return Transpose(*this); }
+
+    Eigen::Index rows() const { return rows_; }
+    Eigen::Index cols() const { return rows_; }
+
+    std::vector<Panel> const & panels() const { return panels_; }
+
+    // apply Q (or its adjoint) in place to the columns of res
+    template<typename Dest>
+    void applyInPlace(Dest & res, bool transpose) const {
+        using namespace Eigen;
+        eigen_assert(res.rows() == rows_ && "Non conforming object sizes");
+        Index const npanels = static_cast<Index>(panels_.size());
+        DenseMatrix sub, W;
+        for (Index i = 0; i < npanels; i++) {
+            // Q = P_0 P_1 ... applies the last panel first; Q^* the reverse
+            Panel const & panel = panels_[transpose ? i : (npanels - i - 1)];
+            Index const r = static_cast<Index>(panel.rows.size());
+
+            sub.resize(r, res.cols());
+            for (Index c = 0; c < res.cols(); c++) {
+                for (Index j = 0; j < r; j++) {
+                    sub(j, c) = res(panel.rows[j], c);
+                }
+            }
+
+            W.noalias() = panel.V.adjoint() * sub;
+            if (transpose) {
+                W = panel.T.adjoint().template triangularView<Lower>() * W;
+            } else {
+                W = panel.T.template triangularView<Upper>() * W;
+            }
+            sub.noalias() -= panel.V * W;
+
+            for (Index c = 0; c < res.cols(); c++) {
+                for (Index j = 0; j < r; j++) {
+                    res(panel.rows[j], c) = sub(j, c);
+                }
+            }
+        }
+    }
+
+private:
+    Eigen::Index       rows_;
+    std::vector<Panel> panels_;
+};
+
+template<typename SparseQRType, typename Derived>
+struct BlockedQProduct : Eigen::ReturnByValue<BlockedQProduct<SparseQRType, Derived>> {
+    BlockedQProduct(BlockedHouseholderQ<SparseQRType> const & q, Derived const & other, bool transpose)
+        : q_(q), other_(other), transpose_(transpose) {}
+
+    Eigen::Index rows() const { return q_.rows(); }
+    Eigen::Index cols() const { return other_.cols(); }
+
+    template<typename Dest>
+    void evalTo(Dest & res) const {
+        res = other_;
+        q_.applyInPlace(res, transpose_);
+    }
+
+private:
+    BlockedHouseholderQ<SparseQRType> const & q_;
+    Derived const &                           other_;
+    bool                                      transpose_;   // actually adjoint, as in SparseQR
+};
+
+#endif // BLOCKED_Q_HPP
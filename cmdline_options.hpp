@@ -0,0 +1,32 @@
+// command line options shared by the benchmark and verification programs
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef CMDLINE_OPTIONS_HPP
+#define CMDLINE_OPTIONS_HPP
+
+#include <algorithm>
+#include <string>
+
+// Look for an option of the form "--name=value" (in the benchmarks, after gbench
+// has removed its own arguments).  If found, remove it from argv so positional arguments
+// keep their places, and return the value; otherwise return the default.
+inline std::string
+TakeOption(int & argc, char* argv[], std::string const & name, std::string const & dflt) {
+    std::string const prefix = name + "=";
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, prefix.size(), prefix) == 0) {
+            std::rotate(argv + i, argv + i + 1, argv + argc);
+            argc--;
+            return arg.substr(prefix.size());
+        }
+    }
+    return dflt;
+}
+
+#endif // CMDLINE_OPTIONS_HPP
@@ -0,0 +1,168 @@
+// forming Q from the sparse QR Householder sequence without a dense m x m intermediate
+//
+// Copyright (C) 2017 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef GENERATE_Q_HPP
+#define GENERATE_Q_HPP
+
+#include <algorithm>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "householder_reach.hpp"
+#include "parallel_q.hpp"
+#include "qr_stats.hpp"
+#include "sparse_qr_access.hpp"
+
+// Q as a SparseMatrix, built column by column as Q e_j.  A first, symbolic,
+// pass finds the pattern of every column from the structure of the Householder
+// vectors alone, so the result can be allocated exactly; the numeric pass then
+// applies only the reflectors that reach each column, using a single dense
+// work vector.  Peak memory is nnz(Q) plus O(rows).
+// The pattern is structural, so entries that cancel numerically are kept as
+// explicit zeros.
+template<typename SparseQRType>
+Eigen::SparseMatrix<typename SparseQRType::Scalar, Eigen::ColMajor, typename SparseQRType::StorageIndex>
+SparseQ(Eigen::SparseQRMatrixQReturnType<SparseQRType> const & matrixQ) {
+    using namespace Eigen;
+    using Scalar = typename SparseQRType::Scalar;
+    using StorageIndex = typename SparseQRType::StorageIndex;
+    SparseQRType const & qr = matrixQ.m_qr;
+    auto const & vecs   = HouseholderVectors(qr);
+    auto const & hcoeff = HouseholderCoeffs(qr);
+    Index const m = qr.rows();
+    Index const diagSize = (std::min)(qr.rows(), qr.cols());
+
+    QRStats * const stats = QRStatsFor(qr);
+    QRPhaseTimer timer(stats, QRPhase::QGeneration);
+    QRCounts counts;
+
+    HouseholderReach<SparseQRType> reach(qr);
+    auto noop = [](Index) {};
+
+    // symbolic pass: column counts
+    SparseMatrix<Scalar, ColMajor, StorageIndex> result(m, m);
+    StorageIndex * outer = result.outerIndexPtr();
+    outer[0] = 0;
+    for (Index j = 0; j < m; j++) {
+        StorageIndex const row = StorageIndex(j);
+        // as with the identity optimization, only reflectors up to j can affect e_j
+        reach.traverse(&row, &row + 1, 0, numext::mini(j+1, diagSize), false, noop);
+        outer[j+1] = outer[j] + StorageIndex(reach.pattern().size());
+    }
+    result.resizeNonZeros(outer[m]);
+
+    // numeric pass
+    Matrix<Scalar, Dynamic, 1> x = Matrix<Scalar, Dynamic, 1>::Zero(m);
+    StorageIndex * inner = result.innerIndexPtr();
+    Scalar * values = result.valuePtr();
+    for (Index j = 0; j < m; j++) {
+        StorageIndex const row = StorageIndex(j);
+        x(j) = Scalar(1);
+        long long applied = 0;
+        reach.traverse(&row, &row + 1, 0, numext::mini(j+1, diagSize), false,
+                       [&](Index k) {
+                           if (stats) {
+                               counts.apply(1, vecs.col(k).nonZeros(), 1, sizeof(Scalar), sizeof(StorageIndex));
+                               applied++;
+                           }
+                           Scalar tau = vecs.col(k).dot(x);
+                           if (tau == Scalar(0)) {
+                               return;
+                           }
+                           tau *= numext::conj(hcoeff(k));
+                           for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs, k); it; ++it) {
+                               x(it.row()) -= tau * it.value();
+                           }
+                       });
+        // gather the column (in row order) and clear the work vector for the next
+        auto const & pattern = reach.pattern();
+        std::copy(pattern.begin(), pattern.end(), inner + outer[j]);
+        std::sort(inner + outer[j], inner + outer[j+1]);
+        for (StorageIndex p = outer[j]; p < outer[j+1]; p++) {
+            values[p] = x(inner[p]);
+            x(inner[p]) = Scalar(0);
+        }
+        // skipped by the identity optimization, or not reaching the column
+        if (stats) {
+            Index const end = numext::mini(j+1, diagSize);
+            counts.skip(diagSize - end, 1);
+            counts.unreached(end - applied, 1);
+        }
+    }
+    if (stats) {
+        stats->addCounts(QRPhase::QGeneration, counts);
+    }
+
+    return result;
+}
+
+// The first k columns of Q (or of Q'), allocating only rows x k.  Each column
+// starts as a unit vector e_j.  For Q only the reflectors up to j can affect
+// it, as in the identity optimization; for Q' the reflectors before the first
+// one with a nonzero in row j leave it unchanged, so we skip those.
+template<typename SparseQRType>
+Eigen::Matrix<typename SparseQRType::Scalar, Eigen::Dynamic, Eigen::Dynamic>
+ThinQColumns(SparseQRType const & qr, Eigen::Index k, bool transpose) {
+    using namespace Eigen;
+    using Scalar = typename SparseQRType::Scalar;
+    auto const & vecs = HouseholderVectors(qr);
+    Index const m = qr.rows();
+    Index const diagSize = (std::min)(qr.rows(), qr.cols());
+    eigen_assert((k >= 0) && (k <= m) && "thin Q cannot have more columns than Q");
+
+    std::vector<Index> first;
+    if (transpose) {
+        first.assign(k, diagSize);
+        for (Index r = 0; r < diagSize; r++) {
+            for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs, r); it; ++it) {
+                if ((it.row() < k) && (first[it.row()] == diagSize)) {
+                    first[it.row()] = r;
+                }
+            }
+        }
+    }
+
+    QRStats * const stats = QRStatsFor(qr);
+    QRPhaseTimer timer(stats, QRPhase::QGeneration);
+    QRCounts counts;
+    Matrix<Scalar, Dynamic, Dynamic> result = Matrix<Scalar, Dynamic, Dynamic>::Zero(m, k);
+    for (Index j = 0; j < k; j++) {
+        result(j, j) = Scalar(1);
+        Index const begin = transpose ? first[j] : 0;
+        Index const end = transpose ? diagSize : numext::mini(j+1, diagSize);
+        ApplyHouseholderColumn(qr, result.col(j), begin, end, transpose);
+        if (stats) {
+            counts.apply(end - begin, ReflectorNonZeros(qr, begin, end), 1,
+                         sizeof(Scalar), sizeof(typename SparseQRType::StorageIndex));
+            counts.skip(diagSize - end, 1);
+            counts.unreached(begin, 1);
+        }
+    }
+    if (stats) {
+        stats->addCounts(QRPhase::QGeneration, counts);
+    }
+    return result;
+}
+
+// ThinQ(qr.matrixQ(), k) is the first k columns of Q
+template<typename SparseQRType>
+Eigen::Matrix<typename SparseQRType::Scalar, Eigen::Dynamic, Eigen::Dynamic>
+ThinQ(Eigen::SparseQRMatrixQReturnType<SparseQRType> const & matrixQ, Eigen::Index k) {
+    return ThinQColumns(matrixQ.m_qr, k, false);
+}
+
+// ThinQ(qr.matrixQ().transpose(), k) is the first k columns of Q' (the adjoint)
+template<typename SparseQRType>
+Eigen::Matrix<typename SparseQRType::Scalar, Eigen::Dynamic, Eigen::Dynamic>
+ThinQ(Eigen::SparseQRMatrixQTransposeReturnType<SparseQRType> const & matrixQt, Eigen::Index k) {
+    return ThinQColumns(matrixQt.m_qr, k, true);
+}
+
+#endif // GENERATE_Q_HPP
@@ -0,0 +1,357 @@
+// vectorized sparse dot and axpy kernels for applying Householder reflectors
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef HOUSEHOLDER_KERNELS_HPP
+#define HOUSEHOLDER_KERNELS_HPP
+
+#include <atomic>
+#include <Eigen/Core>
+
+// Applying one reflector to a dense column x is a dot product of the sparse
+// Householder vector with x, then an axpy of it back into x - a gather and a
+// scatter through the vector's row indices.  Here those are vectorized with
+// AVX2 gathers (the scatter stays scalar: AVX2 has none) or AVX-512 gathers
+// and scatters, chosen at run time by what the CPU supports.  Each kernel
+// handles C right hand side columns at once, loading each block of row
+// indices and Householder values just once for all of them; C = 1 is the
+// plain single column case.
+// The row indices of one Householder vector are distinct, so the scatters
+// never conflict.  Only real float and double with int indices are
+// vectorized; anything else uses the scalar loops.
+
+enum class SimdLevel { Scalar = 0, AVX2 = 1, AVX512 = 2 };
+
+inline SimdLevel
+DetectSimdLevel() {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    static SimdLevel const level =
+        __builtin_cpu_supports("avx512f") ? SimdLevel::AVX512 :
+        (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? SimdLevel::AVX2 :
+        SimdLevel::Scalar;
+    return level;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+// an upper limit on the instruction set used, for comparing kernels
+inline std::atomic<int> &
+SimdLevelLimit() {
+    static std::atomic<int> limit(int(SimdLevel::AVX512));
+    return limit;
+}
+
+inline void
+LimitSimdLevel(SimdLevel level) {
+    SimdLevelLimit().store(int(level), std::memory_order_relaxed);
+}
+
+inline SimdLevel
+ActiveSimdLevel() {
+    return SimdLevel((std::min)(int(DetectSimdLevel()), SimdLevelLimit().load(std::memory_order_relaxed)));
+}
+
+inline char const *
+SimdLevelName(SimdLevel level) {
+    return (level == SimdLevel::AVX512) ? "AVX-512" : (level == SimdLevel::AVX2) ? "AVX2" : "scalar";
+}
+
+namespace householder_kernels {
+
+// out[c] = sum_i v[i] * x[c*ld + idx[i]]
+template<int C, typename Scalar>
+void DotColumnsScalar(Eigen::Index n, int const * idx, Scalar const * v,
+                      Scalar const * x, Eigen::Index ld, Scalar * out) {
+    for (int c = 0; c < C; c++) {
+        Scalar acc(0);
+        for (Eigen::Index i = 0; i < n; i++) {
+            acc += v[i] * x[c*ld + idx[i]];
+        }
+        out[c] = acc;
+    }
+}
+
+// x[c*ld + idx[i]] -= alpha[c] * v[i]
+template<int C, typename Scalar>
+void AxpyColumnsScalar(Eigen::Index n, int const * idx, Scalar const * v,
+                       Scalar const * alpha, Scalar * x, Eigen::Index ld) {
+    for (int c = 0; c < C; c++) {
+        if (alpha[c] == Scalar(0)) {
+            continue;
+        }
+        for (Eigen::Index i = 0; i < n; i++) {
+            x[c*ld + idx[i]] -= alpha[c] * v[i];
+        }
+    }
+}
+
+} // namespace householder_kernels
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define HOUSEHOLDER_KERNELS_SIMD 1
+
+#include <immintrin.h>
+
+// Each instruction set gets the same two kernels, written against a small
+// per-type wrapper of its intrinsics, and compiled for that instruction set
+// alone so nothing from it leaks into code that runs without a check.
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+
+namespace householder_kernels {
+namespace avx2 {
+
+template<typename Scalar> struct Simd;
+
+template<>
+struct Simd<double> {
+    static constexpr int lanes = 4;
+    using Vec = __m256d;
+    using Idx = __m128i;
+    static Idx loadIndex(int const * p) { return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p)); }
+    static Vec load(double const * p) { return _mm256_loadu_pd(p); }
+    static Vec gather(double const * base, Idx idx) { return _mm256_i32gather_pd(base, idx, 8); }
+    static Vec zero() { return _mm256_setzero_pd(); }
+    static Vec set1(double a) { return _mm256_set1_pd(a); }
+    static Vec fmadd(Vec a, Vec b, Vec c) { return _mm256_fmadd_pd(a, b, c); }
+    static Vec fnmadd(Vec a, Vec b, Vec c) { return _mm256_fnmadd_pd(a, b, c); }
+    static double sum(Vec a) {
+        __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+        return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+    }
+    static void scatter(double * base, int const * idx, Idx, Vec a) {
+        alignas(32) double t[lanes];
+        _mm256_store_pd(t, a);
+        for (int l = 0; l < lanes; l++) {
+            base[idx[l]] = t[l];
+        }
+    }
+};
+
+template<>
+struct Simd<float> {
+    static constexpr int lanes = 8;
+    using Vec = __m256;
+    using Idx = __m256i;
+    static Idx loadIndex(int const * p) { return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p)); }
+    static Vec load(float const * p) { return _mm256_loadu_ps(p); }
+    static Vec gather(float const * base, Idx idx) { return _mm256_i32gather_ps(base, idx, 4); }
+    static Vec zero() { return _mm256_setzero_ps(); }
+    static Vec set1(float a) { return _mm256_set1_ps(a); }
+    static Vec fmadd(Vec a, Vec b, Vec c) { return _mm256_fmadd_ps(a, b, c); }
+    static Vec fnmadd(Vec a, Vec b, Vec c) { return _mm256_fnmadd_ps(a, b, c); }
+    static float sum(Vec a) {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehdup_ps(s)));
+    }
+    static void scatter(float * base, int const * idx, Idx, Vec a) {
+        alignas(32) float t[lanes];
+        _mm256_store_ps(t, a);
+        for (int l = 0; l < lanes; l++) {
+            base[idx[l]] = t[l];
+        }
+    }
+};
+
+template<int C, typename Scalar>
+void DotColumns(Eigen::Index n, int const * idx, Scalar const * v,
+                Scalar const * x, Eigen::Index ld, Scalar * out) {
+    using S = Simd<Scalar>;
+    typename S::Vec acc[C];
+    for (int c = 0; c < C; c++) {
+        acc[c] = S::zero();
+    }
+    Eigen::Index i = 0;
+    for (; i + S::lanes <= n; i += S::lanes) {
+        typename S::Idx vi = S::loadIndex(idx + i);
+        typename S::Vec vv = S::load(v + i);
+        for (int c = 0; c < C; c++) {
+            acc[c] = S::fmadd(vv, S::gather(x + c*ld, vi), acc[c]);
+        }
+    }
+    for (int c = 0; c < C; c++) {
+        out[c] = S::sum(acc[c]);
+        for (Eigen::Index t = i; t < n; t++) {
+            out[c] += v[t] * x[c*ld + idx[t]];
+        }
+    }
+}
+
+template<int C, typename Scalar>
+void AxpyColumns(Eigen::Index n, int const * idx, Scalar const * v,
+                 Scalar const * alpha, Scalar * x, Eigen::Index ld) {
+    using S = Simd<Scalar>;
+    typename S::Vec a[C];
+    for (int c = 0; c < C; c++) {
+        a[c] = S::set1(alpha[c]);
+    }
+    Eigen::Index i = 0;
+    for (; i + S::lanes <= n; i += S::lanes) {
+        typename S::Idx vi = S::loadIndex(idx + i);
+        typename S::Vec vv = S::load(v + i);
+        for (int c = 0; c < C; c++) {
+            if (alpha[c] != Scalar(0)) {
+                S::scatter(x + c*ld, idx + i, vi, S::fnmadd(a[c], vv, S::gather(x + c*ld, vi)));
+            }
+        }
+    }
+    for (int c = 0; c < C; c++) {
+        for (Eigen::Index t = i; t < n; t++) {
+            x[c*ld + idx[t]] -= alpha[c] * v[t];
+        }
+    }
+}
+
+} // namespace avx2
+} // namespace householder_kernels
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#pragma clang attribute push (__attribute__((target("avx512f,avx2,fma"))), apply_to = function)
+#else
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#endif
+
+namespace householder_kernels {
+namespace avx512 {
+
+template<typename Scalar> struct Simd;
+
+template<>
+struct Simd<double> {
+    static constexpr int lanes = 8;
+    using Vec = __m512d;
+    using Idx = __m256i;
+    static Idx loadIndex(int const * p) { return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p)); }
+    static Vec load(double const * p) { return _mm512_loadu_pd(p); }
+    static Vec gather(double const * base, Idx idx) { return _mm512_i32gather_pd(idx, base, 8); }
+    static Vec zero() { return _mm512_setzero_pd(); }
+    static Vec set1(double a) { return _mm512_set1_pd(a); }
+    static Vec fmadd(Vec a, Vec b, Vec c) { return _mm512_fmadd_pd(a, b, c); }
+    static Vec fnmadd(Vec a, Vec b, Vec c) { return _mm512_fnmadd_pd(a, b, c); }
+    static double sum(Vec a) { return _mm512_reduce_add_pd(a); }
+    static void scatter(double * base, int const *, Idx idx, Vec a) { _mm512_i32scatter_pd(base, idx, a, 8); }
+};
+
+template<>
+struct Simd<float> {
+    static constexpr int lanes = 16;
+    using Vec = __m512;
+    using Idx = __m512i;
+    static Idx loadIndex(int const * p) { return _mm512_loadu_si512(p); }
+    static Vec load(float const * p) { return _mm512_loadu_ps(p); }
+    static Vec gather(float const * base, Idx idx) { return _mm512_i32gather_ps(idx, base, 4); }
+    static Vec zero() { return _mm512_setzero_ps(); }
+    static Vec set1(float a) { return _mm512_set1_ps(a); }
+    static Vec fmadd(Vec a, Vec b, Vec c) { return _mm512_fmadd_ps(a, b, c); }
+    static Vec fnmadd(Vec a, Vec b, Vec c) { return _mm512_fnmadd_ps(a, b, c); }
+    static float sum(Vec a) { return _mm512_reduce_add_ps(a); }
+    static void scatter(float * base, int const *, Idx idx, Vec a) { _mm512_i32scatter_ps(base, idx, a, 4); }
+};
+
+template<int C, typename Scalar>
+void DotColumns(Eigen::Index n, int const * idx, Scalar const * v,
+                Scalar const * x, Eigen::Index ld, Scalar * out) {
+    using S = Simd<Scalar>;
+    typename S::Vec acc[C];
+    for (int c = 0; c < C; c++) {
+        acc[c] = S::zero();
+    }
+    Eigen::Index i = 0;
+    for (; i + S::lanes <= n; i += S::lanes) {
+        typename S::Idx vi = S::loadIndex(idx + i);
+        typename S::Vec vv = S::load(v + i);
+        for (int c = 0; c < C; c++) {
+            acc[c] = S::fmadd(vv, S::gather(x + c*ld, vi), acc[c]);
+        }
+    }
+    for (int c = 0; c < C; c++) {
+        out[c] = S::sum(acc[c]);
+        for (Eigen::Index t = i; t < n; t++) {
+            out[c] += v[t] * x[c*ld + idx[t]];
+        }
+    }
+}
+
+template<int C, typename Scalar>
+void AxpyColumns(Eigen::Index n, int const * idx, Scalar const * v,
+                 Scalar const * alpha, Scalar * x, Eigen::Index ld) {
+    using S = Simd<Scalar>;
+    typename S::Vec a[C];
+    for (int c = 0; c < C; c++) {
+        a[c] = S::set1(alpha[c]);
+    }
+    Eigen::Index i = 0;
+    for (; i + S::lanes <= n; i += S::lanes) {
+        typename S::Idx vi = S::loadIndex(idx + i);
+        typename S::Vec vv = S::load(v + i);
+        for (int c = 0; c < C; c++) {
+            if (alpha[c] != Scalar(0)) {
+                S::scatter(x + c*ld, idx + i, vi, S::fnmadd(a[c], vv, S::gather(x + c*ld, vi)));
+            }
+        }
+    }
+    for (int c = 0; c < C; c++) {
+        for (Eigen::Index t = i; t < n; t++) {
+            x[c*ld + idx[t]] -= alpha[c] * v[t];
+        }
+    }
+}
+
+} // namespace avx512
+} // namespace householder_kernels
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#endif // x86 with GCC or clang
+
+// the dispatching entry points; level must not exceed DetectSimdLevel()
+
+// out[c] = sum_i v[i] * x[c*ld + idx[i]], for c in [0, C)
+template<int C, typename Scalar>
+void SparseDotColumns(SimdLevel level, Eigen::Index n, int const * idx, Scalar const * v,
+                      Scalar const * x, Eigen::Index ld, Scalar * out) {
+    using namespace householder_kernels;
+#ifdef HOUSEHOLDER_KERNELS_SIMD
+    switch (level) {
+    case SimdLevel::AVX512: avx512::DotColumns<C>(n, idx, v, x, ld, out); return;
+    case SimdLevel::AVX2:   avx2::DotColumns<C>(n, idx, v, x, ld, out); return;
+    default: break;
+    }
+#endif
+    DotColumnsScalar<C>(n, idx, v, x, ld, out);
+}
+
+// x[c*ld + idx[i]] -= alpha[c] * v[i], for c in [0, C)
+template<int C, typename Scalar>
+void SparseAxpyColumns(SimdLevel level, Eigen::Index n, int const * idx, Scalar const * v,
+                       Scalar const * alpha, Scalar * x, Eigen::Index ld) {
+    using namespace householder_kernels;
+#ifdef HOUSEHOLDER_KERNELS_SIMD
+    switch (level) {
+    case SimdLevel::AVX512: avx512::AxpyColumns<C>(n, idx, v, alpha, x, ld); return;
+    case SimdLevel::AVX2:   avx2::AxpyColumns<C>(n, idx, v, alpha, x, ld); return;
+    default: break;
+    }
+#endif
+    AxpyColumnsScalar<C>(n, idx, v, alpha, x, ld);
+}
+
+#endif // HOUSEHOLDER_KERNELS_HPP
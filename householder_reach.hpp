@@ -0,0 +1,138 @@
+// structural reach of a vector through the sparse QR Householder sequence
+//
+// Copyright (C) 2017 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef HOUSEHOLDER_REACH_HPP
+#define HOUSEHOLDER_REACH_HPP
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "sparse_qr_access.hpp"
+
+// A reflector I - tau v v^* can only change a vector x if the patterns of v
+// and x intersect, and when it does the pattern of x grows by that of v.
+// Starting from the initial pattern of x we can therefore find exactly the
+// reflectors that need applying, in order, by keeping a heap of the
+// not-yet-reached reflectors that touch the current pattern.  This costs time
+// proportional to the reflectors actually applied, not to all of them.
+
+template<typename SparseQRType>
+struct HouseholderReach {
+    using StorageIndex = typename SparseQRType::StorageIndex;
+
+    explicit HouseholderReach(SparseQRType const & qr)
+        : vecs_(HouseholderVectors(qr)),
+          rowStart_(qr.rows() + 1, 0),
+          rowStamp_(qr.rows(), 0), reflStamp_(vecs_.cols(), 0), stamp_(0) {
+        using namespace Eigen;
+        // transpose the pattern of the Householder vectors, so we can find
+        // the reflectors touching each row
+        for (Index k = 0; k < vecs_.cols(); k++) {
+            for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs_, k); it; ++it) {
+                rowStart_[it.row() + 1]++;
+            }
+        }
+        std::partial_sum(rowStart_.begin(), rowStart_.end(), rowStart_.begin());
+        rowRefl_.resize(rowStart_.back());
+        std::vector<StorageIndex> next(rowStart_.begin(), rowStart_.end() - 1);
+        for (Index k = 0; k < vecs_.cols(); k++) {
+            for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs_, k); it; ++it) {
+                rowRefl_[next[it.row()]++] = StorageIndex(k);   // ascending within each row
+            }
+        }
+    }
+
+    // Visit the reflectors in [begin, end) that can affect a vector with the
+    // given initial pattern, in the order they are applied: ascending for Q',
+    // descending for Q.  visit(k) is called before the pattern of reflector k
+    // is merged into pattern().  If the visitor calls stop(), the traversal
+    // ends there, without merging reflector k.
+    template<typename RowIter, typename Visitor>
+    void traverse(RowIter rowsBegin, RowIter rowsEnd,
+                  Eigen::Index begin, Eigen::Index end,
+                  bool transpose, Visitor && visit) {
+        using namespace Eigen;
+        newStamp();
+        pattern_.clear();
+        heap_.clear();
+        stopped_ = false;
+        // as a heap ordering: true if reflector a is applied after b
+        auto appliedAfter = [transpose](StorageIndex a, StorageIndex b) {
+            return transpose ? (a > b) : (a < b);
+        };
+
+        // reflectors yet to come that touch this row become candidates
+        StorageIndex current = transpose ? StorageIndex(begin - 1) : StorageIndex(end);
+        auto addRow = [&](Index row) {
+            if (rowStamp_[row] == stamp_) {
+                return;
+            }
+            rowStamp_[row] = stamp_;
+            pattern_.push_back(StorageIndex(row));
+            for (StorageIndex p = rowStart_[row]; p < rowStart_[row+1]; p++) {
+                StorageIndex k = rowRefl_[p];
+                if ((k < begin) || (k >= end) || (reflStamp_[k] == stamp_) || !appliedAfter(k, current)) {
+                    continue;
+                }
+                reflStamp_[k] = stamp_;
+                heap_.push_back(k);
+                std::push_heap(heap_.begin(), heap_.end(), appliedAfter);
+            }
+        };
+
+        for (RowIter it = rowsBegin; it != rowsEnd; ++it) {
+            addRow(*it);
+        }
+        while (!heap_.empty()) {
+            std::pop_heap(heap_.begin(), heap_.end(), appliedAfter);
+            current = heap_.back();
+            heap_.pop_back();
+            visit(Index(current));
+            if (stopped_) {
+                break;
+            }
+            for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs_, current); it; ++it) {
+                addRow(it.row());
+            }
+        }
+    }
+
+    // end the current traversal after the visitor returns
+    void stop() { stopped_ = true; }
+
+    // the number of reflectors reached but not yet visited
+    std::size_t candidates() const { return heap_.size(); }
+
+    // the rows reached by the last traversal (unordered)
+    std::vector<StorageIndex> const & pattern() const { return pattern_; }
+
+private:
+    void newStamp() {
+        if (++stamp_ == 0) {
+            // wrapped around; start over
+            std::fill(rowStamp_.begin(), rowStamp_.end(), 0);
+            std::fill(reflStamp_.begin(), reflStamp_.end(), 0);
+            stamp_ = 1;
+        }
+    }
+
+    typename SparseQRType::QRMatrixType const & vecs_;
+    std::vector<StorageIndex> rowStart_;   // row -> reflectors, compressed
+    std::vector<StorageIndex> rowRefl_;
+    std::vector<unsigned>     rowStamp_;   // row already in the pattern?
+    std::vector<unsigned>     reflStamp_;  // reflector already a candidate?
+    unsigned                  stamp_;
+    std::vector<StorageIndex> pattern_;
+    std::vector<StorageIndex> heap_;
+    bool                      stopped_ = false;
+};
+
+#endif // HOUSEHOLDER_REACH_HPP
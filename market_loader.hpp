@@ -0,0 +1,388 @@
+// fast MatrixMarket loading: memory-mapped, parsed in parallel, with an optional binary sidecar
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef MARKET_LOADER_HPP
+#define MARKET_LOADER_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+
+#include "binary_io.hpp"
+
+// A replacement for loadMarket from unsupported/Eigen/SparseExtra, for inputs
+// large enough that iostreams parsing dominates.  The file is mapped into
+// memory and the entries divided, at line boundaries, among threads that each
+// parse into their own triplet buffer; the matrix is then assembled from all
+// the buffers at once.  Only the coordinate format is supported, with real,
+// integer or pattern values and general, symmetric or skew-symmetric storage.
+
+namespace market_detail {
+
+inline bool IsBlank(char c) { return (c == ' ') || (c == '\t') || (c == '\r'); }
+
+inline char const * SkipBlanks(char const * p, char const * end) {
+    while ((p != end) && IsBlank(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+inline bool ParseIndex(char const * & p, char const * end, std::int64_t & result) {
+    p = SkipBlanks(p, end);
+    if ((p == end) || !std::isdigit(static_cast<unsigned char>(*p))) {
+        return false;
+    }
+    result = 0;
+    while ((p != end) && std::isdigit(static_cast<unsigned char>(*p))) {
+        result = result * 10 + (*p++ - '0');
+    }
+    return true;
+}
+
+// Decimal to double without the locale (and without the copying iostreams
+// need).  Values with at most 19 significant digits and a small enough
+// exponent are converted exactly with one multiply or divide, as in strtod's
+// own fast path; anything else is handed to strtod itself.
+inline bool ParseReal(char const * & p, char const * end, double & result) {
+    static double const powers[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    p = SkipBlanks(p, end);
+    char const * start = p;
+    bool negative = false;
+    if ((p != end) && ((*p == '-') || (*p == '+'))) {
+        negative = (*p++ == '-');
+    }
+    std::uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false, truncated = false;
+    for (; (p != end) && std::isdigit(static_cast<unsigned char>(*p)); ++p, any = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += (mantissa != 0);
+        } else {
+            truncated = true;
+        }
+    }
+    if ((p != end) && (*p == '.')) {
+        for (++p; (p != end) && std::isdigit(static_cast<unsigned char>(*p)); ++p, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += (mantissa != 0);
+                exponent--;
+            } else {
+                truncated = true;
+            }
+        }
+    }
+    if (!any) {
+        return false;
+    }
+    if ((p != end) && ((*p == 'e') || (*p == 'E') || (*p == 'd') || (*p == 'D'))) {
+        ++p;
+        bool negexp = false;
+        if ((p != end) && ((*p == '-') || (*p == '+'))) {
+            negexp = (*p++ == '-');
+        }
+        std::int64_t e;
+        if (!ParseIndex(p, end, e)) {
+            return false;
+        }
+        exponent += int(negexp ? -std::min<std::int64_t>(e, 100000) : std::min<std::int64_t>(e, 100000));
+    }
+
+    if (!truncated && (mantissa < (std::uint64_t(1) << 53)) && (exponent >= -22) && (exponent <= 22)) {
+        double value = double(mantissa);
+        value = (exponent < 0) ? value / powers[-exponent] : value * powers[exponent];
+        result = negative ? -value : value;
+        return true;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // Full 19-digit mantissas (what saveMarket writes) are exact in x87
+    // extended precision, as are powers of ten up to 10^27, so one multiply or
+    // divide rounds just once, to 64 bits.  Rounding that to double gives the
+    // correctly rounded result unless it lies within an extended ulp of a
+    // halfway point between doubles, which we leave to strtod.
+    static_assert(std::numeric_limits<long double>::digits == 64, "expected x87 long double");
+    if (!truncated && (exponent >= -27) && (exponent <= 27)) {
+        static long double const powersExt[] = {
+            1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+            1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+            1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L};
+        long double const power = powersExt[std::abs(exponent)];
+        long double value = (long double)mantissa;
+        value = (exponent < 0) ? value / power : value * power;
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));   // the explicit 64-bit significand
+        std::uint64_t const low = bits & 0x7FF;
+        if ((value == 0.0L) || ((low < 0x3FF) || (low > 0x401))) {
+            result = negative ? -double(value) : double(value);
+            return true;
+        }
+    }
+#endif
+
+    // slow path: strtod wants a terminated string and a '.' decimal point,
+    // which is what it gets in the default "C" locale
+    char text[64];
+    std::size_t const len = std::min<std::size_t>(p - start, sizeof(text) - 1);
+    std::replace_copy_if(start, start + len, text, [](char c) { return (c == 'd') || (c == 'D'); }, 'e');
+    text[len] = '\0';
+    result = std::strtod(text, nullptr);
+    return true;
+}
+
+template<typename Scalar>
+struct Triplet {
+    std::int64_t row, col;
+    Scalar       value;
+};
+
+// run f(0) ... f(nthreads-1) concurrently, f(0) on the calling thread
+template<typename F>
+void
+RunInThreads(unsigned nthreads, F && f) {
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < nthreads; t++) {
+        workers.emplace_back(f, t);
+    }
+    f(0u);
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+// Build a compressed matrix straight from the parsed triplets: count, then
+// scatter, then sort (if the file was not already ordered) and sum duplicates
+// within each inner vector.  Files are usually written in order, which makes
+// the scatter sequential and the sort a no-op, unlike setFromTriplets, which
+// always goes through a transposed copy.
+template<typename Scalar, int Options, typename StorageIndex>
+void
+AssembleCompressed(Eigen::SparseMatrix<Scalar, Options, StorageIndex> & mat,
+                   std::int64_t rows, std::int64_t cols,
+                   std::vector<std::vector<Triplet<Scalar>>> const & chunks, unsigned nthreads) {
+    using Eigen::Index;
+    bool const rowMajor = (Options & Eigen::RowMajor) != 0;
+    Index const outerSize = rowMajor ? rows : cols;
+    auto outerOf = [rowMajor](Triplet<Scalar> const & t) { return rowMajor ? t.row : t.col; };
+    auto innerOf = [rowMajor](Triplet<Scalar> const & t) { return rowMajor ? t.col : t.row; };
+
+    mat.resize(rows, cols);
+    StorageIndex * outer = mat.outerIndexPtr();
+    std::fill(outer, outer + outerSize + 1, StorageIndex(0));
+    for (auto const & chunk : chunks) {
+        for (auto const & t : chunk) {
+            outer[outerOf(t) + 1]++;
+        }
+    }
+    std::partial_sum(outer, outer + outerSize + 1, outer);
+    mat.resizeNonZeros(outer[outerSize]);
+
+    StorageIndex * inner = mat.innerIndexPtr();
+    Scalar * values = mat.valuePtr();
+    std::vector<StorageIndex> pos(outer, outer + outerSize);
+    for (auto const & chunk : chunks) {
+        for (auto const & t : chunk) {
+            StorageIndex p = pos[outerOf(t)]++;
+            inner[p] = StorageIndex(innerOf(t));
+            values[p] = t.value;
+        }
+    }
+
+    std::vector<StorageIndex> length(outerSize);
+    RunInThreads(nthreads, [&](unsigned t) {
+            std::vector<std::pair<StorageIndex, Scalar>> entries;
+            for (Index j = outerSize * t / nthreads; j < outerSize * (t+1) / nthreads; j++) {
+                StorageIndex * in = inner + outer[j];
+                Scalar * val = values + outer[j];
+                StorageIndex const n = outer[j+1] - outer[j];
+                if (!std::is_sorted(in, in + n)) {
+                    entries.clear();
+                    for (StorageIndex p = 0; p < n; p++) {
+                        entries.emplace_back(in[p], val[p]);
+                    }
+                    std::sort(entries.begin(), entries.end(),
+                              [](std::pair<StorageIndex, Scalar> const & a,
+                                 std::pair<StorageIndex, Scalar> const & b) { return a.first < b.first; });
+                    for (StorageIndex p = 0; p < n; p++) {
+                        std::tie(in[p], val[p]) = entries[p];
+                    }
+                }
+                StorageIndex k = 0;
+                for (StorageIndex p = 0; p < n; p++) {
+                    if ((k > 0) && (in[k-1] == in[p])) {
+                        val[k-1] += val[p];
+                    } else {
+                        in[k] = in[p];
+                        val[k++] = val[p];
+                    }
+                }
+                length[j] = k;
+            }
+        });
+
+    // close the gaps left by duplicates, if there were any
+    if (std::accumulate(length.begin(), length.end(), StorageIndex(0)) != outer[outerSize]) {
+        StorageIndex dst = 0;
+        for (Index j = 0; j < outerSize; j++) {
+            StorageIndex const src = outer[j];
+            std::copy(inner + src, inner + src + length[j], inner + dst);
+            std::copy(values + src, values + src + length[j], values + dst);
+            outer[j] = dst;
+            dst += length[j];
+        }
+        outer[outerSize] = dst;
+        mat.resizeNonZeros(dst);
+    }
+}
+
+inline bool
+Newer(std::string const & path, std::string const & than) {
+    struct stat a, b;
+    if ((::stat(path.c_str(), &a) != 0) || (::stat(than.c_str(), &b) != 0)) {
+        return false;
+    }
+    return (a.st_mtim.tv_sec > b.st_mtim.tv_sec) ||
+        ((a.st_mtim.tv_sec == b.st_mtim.tv_sec) && (a.st_mtim.tv_nsec >= b.st_mtim.tv_nsec));
+}
+
+} // namespace market_detail
+
+// Load a MatrixMarket coordinate file into mat, using up to nthreads threads
+// to parse it.  With useSidecar, a binary copy is kept at path + ".bin" and
+// used instead of the text whenever it is at least as new; as that writes
+// next to the input, it is off by default.  Returns false if the file cannot
+// be read, is not in a supported format, or does not hold as many entries as
+// its size line declares.
+template<typename Scalar, int Options, typename StorageIndex>
+bool
+LoadMarketFast(Eigen::SparseMatrix<Scalar, Options, StorageIndex> & mat, std::string const & path,
+               unsigned nthreads = std::thread::hardware_concurrency(), bool useSidecar = false) {
+    using namespace market_detail;
+    char const magic[] = "EQMARKET";
+    std::string const sidecar = path + ".bin";
+
+    if (useSidecar && Newer(sidecar, path)) {
+        MappedFile file(sidecar);
+        if (file.valid()) {
+            BinaryReader in(file.data(), file.size());
+            if (ReadBinaryHeader<Scalar, StorageIndex>(in, magic) && ReadSparse(in, mat)) {
+                return true;
+            }
+        }
+    }
+
+    MappedFile file(path);
+    if (!file.valid()) {
+        return false;
+    }
+    char const * p = file.data();
+    char const * const end = p + file.size();
+    auto nextLine = [end](char const * q) {
+        q = std::find(q, end, '\n');
+        return (q == end) ? end : q + 1;
+    };
+
+    // banner: %%MatrixMarket matrix coordinate <field> <symmetry>
+    std::string banner(p, std::find(p, end, '\n'));
+    std::transform(banner.begin(), banner.end(), banner.begin(),
+                   [](char c) { return char(std::tolower(static_cast<unsigned char>(c))); });
+    if ((banner.compare(0, 14, "%%matrixmarket") != 0) ||
+        (banner.find(" coordinate") == std::string::npos) ||
+        (banner.find(" complex") != std::string::npos) ||
+        (banner.find(" hermitian") != std::string::npos)) {
+        return false;
+    }
+    bool const pattern   = banner.find(" pattern") != std::string::npos;
+    bool const skew      = banner.find(" skew-symmetric") != std::string::npos;
+    bool const symmetric = skew || (banner.find(" symmetric") != std::string::npos);
+
+    // comments, then the size line
+    do {
+        p = nextLine(p);
+    } while ((p != end) && (*p == '%'));
+    std::int64_t rows, cols, nnz;
+    if (!ParseIndex(p, end, rows) || !ParseIndex(p, end, cols) || !ParseIndex(p, end, nnz)) {
+        return false;
+    }
+    p = nextLine(p);
+
+    // split the entries into roughly equal byte ranges ending at newlines
+    nthreads = std::max(1u, std::min<unsigned>(nthreads, unsigned(nnz / 100000 + 1)));
+    std::vector<char const *> bounds{p};
+    for (unsigned t = 1; t < nthreads; t++) {
+        char const * b = p + (end - p) * t / nthreads;
+        bounds.push_back(std::max(bounds.back(), nextLine(std::max(b - 1, p))));
+    }
+    bounds.push_back(end);
+
+    std::vector<std::vector<Triplet<Scalar>>> chunks(nthreads);
+    std::vector<char> ok(nthreads, 1);
+    std::vector<std::int64_t> entries(nthreads, 0);     // lines parsed, before symmetric mirroring
+    auto parse = [&](unsigned t) {
+        auto & triplets = chunks[t];
+        triplets.reserve(std::size_t(nnz / nthreads + 1) * (symmetric ? 2 : 1));
+        for (char const * q = bounds[t]; q < bounds[t+1]; q = nextLine(q)) {
+            char const * line = SkipBlanks(q, bounds[t+1]);
+            if ((line == bounds[t+1]) || (*line == '\n') || (*line == '%')) {
+                continue;
+            }
+            std::int64_t i, j;
+            double value = 1.0;
+            if (!ParseIndex(line, end, i) || !ParseIndex(line, end, j) ||
+                (!pattern && !ParseReal(line, end, value)) ||
+                (i < 1) || (i > rows) || (j < 1) || (j > cols)) {
+                ok[t] = 0;
+                return;
+            }
+            triplets.push_back({i - 1, j - 1, Scalar(value)});
+            entries[t]++;
+            if (symmetric && (i != j)) {
+                triplets.push_back({j - 1, i - 1, Scalar(skew ? -value : value)});
+            }
+        }
+    };
+    RunInThreads(nthreads, parse);
+    // a file cut short (or padded) has a different number of entries than it declares
+    if ((std::find(ok.begin(), ok.end(), 0) != ok.end()) ||
+        (std::accumulate(entries.begin(), entries.end(), std::int64_t(0)) != nnz)) {
+        return false;
+    }
+
+    AssembleCompressed(mat, rows, cols, chunks, nthreads);
+
+    if (useSidecar) {
+        // failing to write the sidecar only costs us speed next time
+        WriteFileAtomically(sidecar, [&](std::ostream & out) {
+                BinaryHeader header = MakeBinaryHeader<Scalar, StorageIndex>(magic);
+                WriteRaw(out, &header, 1);
+                WriteSparse(out, mat);
+            });
+    }
+    return true;
+}
+
+#endif // MARKET_LOADER_HPP
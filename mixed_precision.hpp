@@ -0,0 +1,220 @@
+// least squares solves with a single precision sparse QR and double precision refinement
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef MIXED_PRECISION_HPP
+#define MIXED_PRECISION_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "condition_estimate.hpp"
+#include "q_workspace.hpp"
+
+// The Householder vectors and R dominate the memory traffic of a sparse QR,
+// and in float they take half the bandwidth they do in double.  This factors
+// the double matrix in float, then recovers double accuracy by iterative
+// refinement, with residuals computed in double and corrections solved for
+// with the float factors.
+//
+// Refining x alone (x += the least squares solution of A d = b - A x) only
+// works for consistent systems: when b is not in the range of A, the float
+// factors' errors in the residual's projection never go away, and x settles
+// at float accuracy.  So for least squares (at least as many rows as columns)
+// we refine x and the residual r together, as the solution of the augmented
+// system (Bjorck)
+//   [ I  A ] [ r ]   [ b ]
+//   [ A' 0 ] [ x ] = [ 0 ]
+// With A P = Q [R; 0], a correction (dr, dx) for residuals f = b - r - A x
+// and g = -A' r is
+//   h = R'^-1 P' g,   (d1; d2) = Q' f,   dx = P R^-1 (d1 - h),   dr = Q (h; d2)
+// costing one application of Q and Q' and two triangular solves, in float.
+// Underdetermined systems are consistent, and refine x alone.
+//
+// Refinement converges whenever the matrix is not too ill conditioned for
+// float - roughly cond(A) well under 1/epsilon(float) - until the corrections
+// reach the rounding level of the double residuals, which is around
+// cond(A) epsilon(double) relative to the solution.  If the corrections stop
+// shrinking above that level, or the step limit is reached, refinement has
+// failed; the matrix is then factored in double (once - later solves use that
+// factorization directly) and the solve is redone with it.  The float
+// factorization uses the rank threshold a double one would; if it still finds
+// the matrix rank deficient it goes straight to double, so results then match
+// SparseQR<double>.
+// The matrix is referenced, not copied, and must outlive this object.
+template<typename OrderingType = Eigen::COLAMDOrdering<int>>
+struct MixedPrecisionQR {
+    using MatrixType = Eigen::SparseMatrix<double>;
+    using LowQRType  = Eigen::SparseQR<Eigen::SparseMatrix<float>, OrderingType>;
+    using HighQRType = Eigen::SparseQR<MatrixType, OrderingType>;
+
+    explicit MixedPrecisionQR(int maxSteps = 10) : maxSteps_(maxSteps) {}
+    explicit MixedPrecisionQR(MatrixType const & mat, int maxSteps = 10) : maxSteps_(maxSteps) {
+        compute(mat);
+    }
+    // the workspace refers to the float factorization, so this cannot move
+    MixedPrecisionQR(MixedPrecisionQR const &) = delete;
+    MixedPrecisionQR & operator=(MixedPrecisionQR const &) = delete;
+
+    void compute(MatrixType const & mat) {
+        mat_ = &mat;
+        high_.reset();
+        workspace_.reset();
+        // SparseQR's default rank threshold scales with epsilon, and in float discards
+        // columns a double factorization keeps.  Use the double threshold instead: if
+        // float cannot resolve those columns well enough, refinement will stall
+        double maxColNorm = 0.0;
+        for (Eigen::Index j = 0; j < mat.cols(); j++) {
+            maxColNorm = (std::max)(maxColNorm, mat.col(j).norm());
+        }
+        low_.setPivotThreshold(float(20 * (mat.rows() + mat.cols()) * (maxColNorm == 0.0 ? 1.0 : maxColNorm) *
+                                     std::numeric_limits<double>::epsilon()));
+        normA_ = maxColNorm;
+        low_.compute(mat.cast<float>());
+        if ((low_.info() != Eigen::Success) ||
+            (low_.rank() < (std::min)(mat.rows(), mat.cols()))) {
+            fallBack();
+        } else {
+            workspace_.reset(new QWorkspace<LowQRType>(low_));
+            Eigen::Index const rank = low_.rank();
+            // through a row-major copy, which sorts the diagonals factorize() leaves last
+            R_ = Eigen::SparseMatrix<float, Eigen::RowMajor>(low_.matrixR().topLeftCorner(rank, rank));
+            condition_ = double(EstimateTriangularCondition(R_));
+        }
+        iterations_ = 0;
+    }
+
+    // the least squares solution of A x = b, as accurate as a double factorization's
+    template<typename Rhs>
+    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>
+    solve(Eigen::MatrixBase<Rhs> const & b) {
+        using namespace Eigen;
+        eigen_assert(mat_ && (b.rows() == mat_->rows()) && "Non conforming object sizes");
+        Matrix<double, Dynamic, Dynamic> x(mat_->cols(), b.cols());
+        iterations_ = 0;
+        for (Index j = 0; j < b.cols(); j++) {
+            if (high_ || !refine(b.col(j), x.col(j))) {
+                fallBack();
+                x.col(j) = high_->solve(b.col(j));
+            }
+        }
+        return x;
+    }
+
+    // refinement steps in the last solve (the most any of its columns took)
+    int iterations() const { return iterations_; }
+
+    // whether refinement failed (or the float factorization did) and solves now
+    // use a double factorization
+    bool usesDoubleFactorization() const { return bool(high_); }
+
+    Eigen::ComputationInfo info() const {
+        return high_ ? high_->info() : low_.info();
+    }
+
+    LowQRType const & lowPrecisionQR() const { return low_; }
+
+private:
+    // refine one column, returning false if it fails
+    template<typename Rhs, typename Dest>
+    bool refine(Rhs const & b, Dest && x) {
+        using namespace Eigen;
+        bool const augmented = mat_->rows() >= mat_->cols();
+        double const tolerance = std::sqrt(double(mat_->cols())) * std::numeric_limits<double>::epsilon();
+        VectorXd r = VectorXd::Zero(mat_->rows());
+        x.setZero();
+        double previous = std::numeric_limits<double>::infinity();
+        for (int step = 0; ; step++) {
+            double const correction = augmented ? augmentedStep(b, x, r) : solutionStep(b, x);
+            if (step > 0) {
+                iterations_ = (std::max)(iterations_, step);
+            }
+            if (correction <= tolerance) {
+                return true;
+            }
+            if (correction > previous / 2) {
+                // no longer contracting: fine only at the level double residuals allow
+                return correction <= condition_ * tolerance;
+            }
+            if (step == maxSteps_) {
+                return false;
+            }
+            previous = correction;
+        }
+    }
+
+    // One correction of x and r = b - A x as the augmented system's solution;
+    // returns its size relative to the solution (zero if there was nothing to
+    // correct).  x's part is measured against the size least squares
+    // sensitivity gives x, which includes a term for the residual.
+    template<typename Rhs, typename Dest>
+    double augmentedStep(Rhs const & b, Dest & x, Eigen::VectorXd & r) {
+        using namespace Eigen;
+        Index const n = mat_->cols();
+        auto const & perm = low_.colsPermutation();
+        VectorXd const f = b - r - (*mat_) * x;
+        VectorXd const g = -(mat_->transpose() * r);
+        // scale the residuals together to keep them in float's range as they shrink
+        double const scale = (std::max)(f.cwiseAbs().maxCoeff(), g.cwiseAbs().maxCoeff());
+        if (scale == 0.0) {
+            return 0.0;
+        }
+        VectorXf d = (f / scale).cast<float>();
+        VectorXf const pg = perm.transpose() * (g / scale).cast<float>();
+        VectorXf const h = R_.transpose().template triangularView<Lower>().solve(pg);
+        workspace_->applyQt(d, d);
+        VectorXf const y = R_.template triangularView<Upper>().solve(d.head(n) - h);
+        d.head(n) = h;
+        workspace_->applyQ(d, d);
+        VectorXd const dx = scale * (perm * y).template cast<double>();
+        VectorXd const dr = scale * d.cast<double>();
+        x += dx;
+        r += dr;
+        double const xscale = x.norm() + (normA_ > 0.0 ? r.norm() / normA_ : 0.0);
+        return (std::max)(dx.norm() / xscale, dr.norm() / b.norm());
+    }
+
+    // one correction of x alone, for an underdetermined (and so consistent) system
+    template<typename Rhs, typename Dest>
+    double solutionStep(Rhs const & b, Dest & x) {
+        using namespace Eigen;
+        VectorXd const r = b - (*mat_) * x;
+        double const scale = r.cwiseAbs().maxCoeff();
+        if (scale == 0.0) {
+            return 0.0;
+        }
+        VectorXf const rf = (r / scale).cast<float>();
+        VectorXf df(mat_->cols());
+        workspace_->solve(rf, df);
+        VectorXd const d = scale * df.cast<double>();
+        x += d;
+        return d.norm() / x.norm();
+    }
+
+    void fallBack() {
+        if (!high_) {
+            high_.reset(new HighQRType(*mat_));
+        }
+    }
+
+    int                                   maxSteps_;
+    MatrixType const *                    mat_ = nullptr;
+    double                                normA_ = 0.0;       // largest column norm
+    LowQRType                             low_;
+    Eigen::SparseMatrix<float>            R_;                 // the float factorization's square R
+    double                                condition_ = 0.0;   // its estimated condition number
+    std::unique_ptr<QWorkspace<LowQRType>> workspace_;
+    std::unique_ptr<HighQRType>           high_;
+    int                                   iterations_ = 0;
+};
+
+#endif // MIXED_PRECISION_HPP
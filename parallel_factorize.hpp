@@ -0,0 +1,297 @@
+// sparse QR factorization in parallel over the column elimination tree
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef PARALLEL_FACTORIZE_HPP
+#define PARALLEL_FACTORIZE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "sparse_qr_access.hpp"
+#include "work_stealing_pool.hpp"
+
+// SparseQR::factorize() is left looking: column k of R and the kth
+// Householder vector are found by applying earlier reflectors to column k of
+// A, and the ones it needs are exactly k's descendants in the column
+// elimination tree.  So disjoint subtrees can be factored at the same time,
+// and a column is ready as soon as its children are done.  Here every column
+// is a task in a work-stealing pool; the thread finishing a column's last
+// child carries straight on with the column itself, so threads work their way
+// up through subtrees and meet where those merge.
+//
+// Each column is computed with the same operations, in the same order, as
+// factorize() uses, into buffers of its own, and the factors are assembled
+// from those at the end.  The result is identical to factorize()'s - bit for
+// bit, with any number of threads.
+//
+// A zero pivot makes factorize() move the column to the end and rebuild the
+// tree, which serializes everything after it, so this handles full column
+// rank with at least as many rows as columns.  Otherwise - when a zero pivot
+// turns up, or the shape rules it out - we fall back to factorize() itself.
+// qr must already have analyzed mat's pattern (by analyzePattern(), AnalyzeQR
+// or ReuseAnalysis).  Returns whether the parallel factorization was used;
+// with one thread it never is, as factorize() is faster alone.
+template<typename SparseQRType, typename MatrixType>
+bool
+ParallelFactorize(SparseQRType & qr, MatrixType const & mat, int nthreads = Eigen::nbThreads()) {
+    using namespace Eigen;
+    using Access = SparseQRAccess<SparseQRType>;
+    using Scalar = typename SparseQRType::Scalar;
+    using RealScalar = typename NumTraits<Scalar>::Real;
+    using StorageIndex = typename SparseQRType::StorageIndex;
+    using QRMatrixType = typename SparseQRType::QRMatrixType;
+    using IndexVector = typename SparseQRType::IndexVector;
+    using ScalarVector = typename SparseQRType::ScalarVector;
+    using PermutationType = typename SparseQRType::PermutationType;
+    // column access, as in analyzePattern
+    using ColumnMatrix = typename internal::conditional<MatrixType::IsRowMajor, QRMatrixType, MatrixType const &>::type;
+    using ColumnIterator = typename internal::remove_all<ColumnMatrix>::type::InnerIterator;
+
+    Index const m = mat.rows(), n = mat.cols();
+    if ((m < n) || (n == 0) || (nthreads <= 1)) {
+        qr.factorize(mat);
+        return false;
+    }
+    ColumnMatrix cm(mat);
+
+    // the elimination tree of the fill-reducing order, which factorize() may have revised
+    PermutationType origPerm = Access::fillPermutation(qr).inverse();    // original column of each column
+    IndexVector etree, firstRowElt;
+    if (Access::eliminationTreeIsCurrent(qr)) {
+        etree = Access::eliminationTree(qr);
+        firstRowElt = Access::firstRowElements(qr);
+    } else {
+        internal::coletree(cm, etree, firstRowElt, origPerm.indices().data());
+    }
+
+    // the pivot threshold, as factorize() chooses it
+    RealScalar pivotThreshold = Access::pivotThreshold(qr);
+    if (Access::usesDefaultThreshold(qr)) {
+        RealScalar max2Norm = 0.0;
+        for (Index j = 0; j < n; j++) {
+            max2Norm = numext::maxi(max2Norm, cm.col(j).norm());
+        }
+        if (max2Norm == RealScalar(0)) {
+            max2Norm = RealScalar(1);
+        }
+        pivotThreshold = 20 * (m + n) * max2Norm * NumTraits<RealScalar>::epsilon();
+    }
+
+    // each column's results: its column of R (the diagonal last), and its
+    // Householder vector and coefficient, in factorize()'s insertion order
+    struct Column {
+        std::vector<StorageIndex> rInner, qInner;
+        std::vector<Scalar>       rValues, qValues;
+        StorageIndex              qOuter[2];    // so the vector can be viewed as a sparse matrix
+        Scalar                    tau;
+    };
+    std::vector<Column> columns(n);
+
+    // per thread scratch space, as in factorize()
+    struct Workspace {
+        Workspace(Index m, Index n)
+            : mark((std::max)(m, n), -1), touched(m, -1), rIdx(n), qIdx(m), tval(ScalarVector::Zero(m)) {}
+        std::vector<StorageIndex> mark, touched, rIdx, qIdx, written;
+        ScalarVector              tval;
+    };
+
+    std::atomic<bool> failed(false);
+
+    // column col, exactly as factorize() computes it when there have been no zero pivots;
+    // false if it has one
+    auto factorColumn = [&](StorageIndex col, Workspace & ws) -> bool {
+        auto & mark = ws.mark;
+        auto & Ridx = ws.rIdx;
+        auto & Qidx = ws.qIdx;
+        auto & tval = ws.tval;
+        auto write = [&](StorageIndex i) {
+            if (ws.touched[i] != col) {
+                ws.touched[i] = col;
+                ws.written.push_back(i);
+            }
+        };
+        StorageIndex const nonzeroCol = col;
+        Index nzcolR = 0, nzcolQ = 1;
+        mark[nonzeroCol] = col;
+        Qidx[0] = nonzeroCol;
+        bool found_diag = false;    // nonzeroCol < m, as m >= n
+        for (ColumnIterator itp(cm, origPerm.indices()(col)); itp || !found_diag; ++itp) {
+            StorageIndex curIdx = nonzeroCol;
+            if (itp) {
+                curIdx = StorageIndex(itp.row());
+            }
+            if (curIdx == nonzeroCol) {
+                found_diag = true;
+            }
+            StorageIndex st = firstRowElt(curIdx);
+            Index bi = nzcolR;
+            for (; mark[st] != col; st = etree(st)) {
+                Ridx[nzcolR] = st;
+                mark[st] = col;
+                nzcolR++;
+            }
+            std::reverse(Ridx.begin() + bi, Ridx.begin() + nzcolR);
+            write(curIdx);
+            tval(curIdx) = itp ? itp.value() : Scalar(0);
+            if ((curIdx > nonzeroCol) && (mark[curIdx] != col)) {
+                Qidx[nzcolQ++] = curIdx;
+                mark[curIdx] = col;
+            }
+        }
+
+        for (Index i = nzcolR - 1; i >= 0; i--) {
+            StorageIndex curIdx = Ridx[i];
+            Column const & h = columns[curIdx];
+            Map<QRMatrixType const> v(m, 1, Index(h.qInner.size()), h.qOuter, h.qInner.data(), h.qValues.data());
+            Scalar tdot = v.col(0).dot(tval);
+            tdot *= h.tau;
+            for (typename Map<QRMatrixType const>::InnerIterator itq(v, 0); itq; ++itq) {
+                write(StorageIndex(itq.row()));
+                tval(itq.row()) -= itq.value() * tdot;
+            }
+            if (etree(curIdx) == nonzeroCol) {
+                for (StorageIndex iQ : h.qInner) {
+                    if (mark[iQ] != col) {
+                        Qidx[nzcolQ++] = iQ;
+                        mark[iQ] = col;
+                    }
+                }
+            }
+        }
+
+        Scalar tau = RealScalar(0);
+        RealScalar beta = 0;
+        Scalar c0 = nzcolQ ? tval(Qidx[0]) : Scalar(0);
+        RealScalar sqrNorm = 0.;
+        for (Index itq = 1; itq < nzcolQ; ++itq) {
+            sqrNorm += numext::abs2(tval(Qidx[itq]));
+        }
+        if ((sqrNorm == RealScalar(0)) && (numext::imag(c0) == RealScalar(0))) {
+            beta = numext::real(c0);
+            tval(Qidx[0]) = 1;
+        } else {
+            using std::sqrt;
+            beta = sqrt(numext::abs2(c0) + sqrNorm);
+            if (numext::real(c0) >= RealScalar(0)) {
+                beta = -beta;
+            }
+            tval(Qidx[0]) = 1;
+            for (Index itq = 1; itq < nzcolQ; ++itq) {
+                tval(Qidx[itq]) /= (c0 - beta);
+            }
+            tau = numext::conj((beta - c0) / beta);
+        }
+
+        Column & out = columns[col];
+        bool const ok = std::abs(beta) >= pivotThreshold;
+        if (ok) {
+            for (Index i = nzcolR - 1; i >= 0; i--) {
+                StorageIndex curIdx = Ridx[i];
+                if (curIdx < nonzeroCol) {
+                    out.rInner.push_back(curIdx);
+                    out.rValues.push_back(tval(curIdx));
+                }
+            }
+            out.rInner.push_back(nonzeroCol);
+            out.rValues.push_back(beta);
+            out.tau = tau;
+            out.qInner.assign(Qidx.begin(), Qidx.begin() + nzcolQ);
+            out.qValues.resize(nzcolQ);
+            for (Index itq = 0; itq < nzcolQ; ++itq) {
+                out.qValues[itq] = tval(Qidx[itq]);
+            }
+            out.qOuter[0] = 0;
+            out.qOuter[1] = StorageIndex(nzcolQ);
+        }
+        // leave tval zero for the next column
+        for (StorageIndex i : ws.written) {
+            tval(i) = Scalar(0);
+        }
+        for (Index itq = 0; itq < nzcolQ; ++itq) {
+            tval(Qidx[itq]) = Scalar(0);
+        }
+        ws.written.clear();
+        return ok;
+    };
+
+    // a column is ready when its children are done; the leaves are ready at once
+    std::unique_ptr<std::atomic<StorageIndex>[]> waiting(new std::atomic<StorageIndex>[n]);
+    for (Index j = 0; j < n; j++) {
+        waiting[j].store(0, std::memory_order_relaxed);
+    }
+    for (Index j = 0; j < n; j++) {
+        if (etree(j) < n) {
+            waiting[etree(j)].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    std::vector<StorageIndex> leaves;
+    for (Index j = 0; j < n; j++) {
+        if (waiting[j].load(std::memory_order_relaxed) == 0) {
+            leaves.push_back(StorageIndex(j));
+        }
+    }
+
+    WorkStealingPool<StorageIndex> pool(nthreads);
+    std::vector<std::unique_ptr<Workspace>> workspaces(pool.threads());
+    pool.run(leaves, [&](StorageIndex col, int thread) {
+        std::unique_ptr<Workspace> & ws = workspaces[thread];
+        if (!ws) {
+            ws.reset(new Workspace(m, n));
+        }
+        // carry on up the tree for as long as this thread finishes the last child
+        while (!failed.load(std::memory_order_relaxed)) {
+            if (!factorColumn(col, *ws)) {
+                failed.store(true, std::memory_order_relaxed);
+                return;
+            }
+            StorageIndex const parent = etree(col);
+            if ((parent >= n) || (waiting[parent].fetch_sub(1, std::memory_order_acq_rel) != 1)) {
+                return;
+            }
+            col = parent;
+        }
+    });
+    if (failed.load()) {
+        qr.factorize(mat);
+        return false;
+    }
+
+    // assemble the factors
+    QRMatrixType R(m, n), Q(m, n);
+    ScalarVector hcoeffs(n);
+    Index nnzR = 0, nnzQ = 0;
+    for (Index j = 0; j < n; j++) {
+        R.outerIndexPtr()[j] = StorageIndex(nnzR);
+        Q.outerIndexPtr()[j] = StorageIndex(nnzQ);
+        nnzR += Index(columns[j].rInner.size());
+        nnzQ += Index(columns[j].qInner.size());
+        hcoeffs(j) = columns[j].tau;
+    }
+    R.outerIndexPtr()[n] = StorageIndex(nnzR);
+    Q.outerIndexPtr()[n] = StorageIndex(nnzQ);
+    R.resizeNonZeros(nnzR);
+    Q.resizeNonZeros(nnzQ);
+    for (Index j = 0; j < n; j++) {
+        Column const & c = columns[j];
+        std::copy(c.rInner.begin(), c.rInner.end(), R.innerIndexPtr() + R.outerIndexPtr()[j]);
+        std::copy(c.rValues.begin(), c.rValues.end(), R.valuePtr() + R.outerIndexPtr()[j]);
+        std::copy(c.qInner.begin(), c.qInner.end(), Q.innerIndexPtr() + Q.outerIndexPtr()[j]);
+        std::copy(c.qValues.begin(), c.qValues.end(), Q.valuePtr() + Q.outerIndexPtr()[j]);
+    }
+    Access::installFactorization(qr, m, n, std::move(R), std::move(Q), std::move(hcoeffs),
+                                 etree, firstRowElt);
+    return true;
+}
+
+#endif // PARALLEL_FACTORIZE_HPP
@@ -0,0 +1,257 @@
+// multithreaded application of the sparse QR Householder sequence
+//
+// Copyright (C) 2017 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef PARALLEL_Q_HPP
+#define PARALLEL_Q_HPP
+
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "householder_kernels.hpp"
+#include "qr_stats.hpp"
+#include "sparse_qr_access.hpp"
+
+// Each column of Q*B (or Q'*B) depends only on the same column of B, so the
+// columns can be divided among threads with no synchronization at all.  We use
+// OpenMP, with the thread count given to ParallelHouseholderQ or, by default,
+// Eigen::nbThreads() at the time of each product, so Eigen::setNbThreads()
+// controls it just as it does Eigen's own parallel products.  Without OpenMP
+// this is the same serial loop SparseQR_QProduct runs.
+
+// whether the vectorized kernels can work on a column's storage directly:
+// real float or double with int indices, in contiguous memory
+template<typename SparseQRType, typename Column>
+struct UsesHouseholderKernels {
+    using Scalar = typename SparseQRType::Scalar;
+    using ColumnType = typename std::decay<Column>::type;
+    static constexpr bool value =
+        (std::is_same<Scalar, float>::value || std::is_same<Scalar, double>::value) &&
+        std::is_same<typename SparseQRType::StorageIndex, int>::value &&
+        std::is_same<typename ColumnType::Scalar, Scalar>::value &&
+        ((int(Eigen::internal::traits<ColumnType>::Flags) & Eigen::DirectAccessBit) != 0) &&
+        (int(ColumnType::InnerStrideAtCompileTime) == 1);
+};
+
+// apply reflectors [begin, end) to the C columns x, x + ld, ... x + (C-1)*ld
+// with the kernels of householder_kernels.hpp
+template<int C, typename SparseQRType>
+void ApplyHouseholderColumns(SparseQRType const & qr, typename SparseQRType::Scalar * x, Eigen::Index ld,
+                             Eigen::Index begin, Eigen::Index end, bool transpose,
+                             SimdLevel level = ActiveSimdLevel()) {
+    using namespace Eigen;
+    using Scalar = typename SparseQRType::Scalar;
+    auto const & vecs   = HouseholderVectors(qr);
+    auto const & hcoeff = HouseholderCoeffs(qr);
+    int const * outer = vecs.outerIndexPtr();
+    int const * nnz   = vecs.innerNonZeroPtr();    // null when compressed
+    for (Index i = begin; i < end; i++) {
+        Index k = transpose ? i : (end - 1 - (i - begin));
+        Index const n = nnz ? nnz[k] : (outer[k+1] - outer[k]);
+        int const * idx = vecs.innerIndexPtr() + outer[k];
+        Scalar const * v = vecs.valuePtr() + outer[k];
+        Scalar tau[C];
+        SparseDotColumns<C>(level, n, idx, v, x, ld, tau);
+        bool any = false;
+        for (int c = 0; c < C; c++) {
+            tau[c] *= hcoeff(k);       // real, so no conjugate
+            any = any || (tau[c] != Scalar(0));
+        }
+        if (any) {
+            SparseAxpyColumns<C>(level, n, idx, v, tau, x, ld);
+        }
+    }
+}
+
+template<typename SparseQRType, typename Column>
+void ApplyHouseholderColumn(SparseQRType const & qr, Column && x,
+                            Eigen::Index begin, Eigen::Index end, bool transpose,
+                            std::true_type) {
+    ApplyHouseholderColumns<1>(qr, &x.coeffRef(0), 0, begin, end, transpose);
+}
+
+template<typename SparseQRType, typename Column>
+void ApplyHouseholderColumn(SparseQRType const & qr, Column && x,
+                            Eigen::Index begin, Eigen::Index end, bool transpose,
+                            std::false_type) {
+    using namespace Eigen;
+    using Scalar = typename SparseQRType::Scalar;
+    auto const & vecs   = HouseholderVectors(qr);
+    auto const & hcoeff = HouseholderCoeffs(qr);
+    for (Index i = begin; i < end; i++) {
+        Index k = transpose ? i : (end - 1 - (i - begin));
+        Scalar tau = vecs.col(k).dot(x);
+        if (tau == Scalar(0)) {
+            continue;
+        }
+        tau *= transpose ? hcoeff(k) : numext::conj(hcoeff(k));
+        x -= tau * vecs.col(k);
+    }
+}
+
+// apply reflectors [begin, end) of the sequence to one column, in ascending
+// order for Q' and descending order for Q
+template<typename SparseQRType, typename Column>
+void ApplyHouseholderColumn(SparseQRType const & qr, Column && x,
+                            Eigen::Index begin, Eigen::Index end, bool transpose) {
+    if ((end <= begin) || (x.size() == 0)) {
+        return;
+    }
+    ApplyHouseholderColumn(qr, std::forward<Column>(x), begin, end, transpose,
+                           std::integral_constant<bool, UsesHouseholderKernels<SparseQRType, Column>::value>());
+}
+
+template<typename SparseQRType, typename Derived> struct ParallelQProduct;
+
+namespace Eigen {
+namespace internal {
+
+template<typename SparseQRType, typename Derived>
+struct traits<ParallelQProduct<SparseQRType, Derived>> {
+    typedef typename Derived::PlainObject ReturnType;
+};
+
+} // namespace internal
+} // namespace Eigen
+
+// nthreads = 0 uses Eigen::nbThreads() as it is when each product is evaluated
+template<typename SparseQRType>
+struct ParallelHouseholderQ {
+    explicit ParallelHouseholderQ(SparseQRType const & qr, int nthreads = 0)
+        : qr_(qr), nthreads_(nthreads) {}
+
+    template<typename Derived>
+    ParallelQProduct<SparseQRType, Derived>
+    operator*(Eigen::MatrixBase<Derived> const & other) const {
+        return ParallelQProduct<SparseQRType, Derived>(qr_, other.derived(), false, nthreads_);
+    }
+
+    // this is the adjoint, like SparseQR's matrixQ().transpose()
+    struct Transpose {
+        Transpose(SparseQRType const & qr, int nthreads) : qr_(qr), nthreads_(nthreads) {}
+
+        template<typename Derived>
+        ParallelQProduct<SparseQRType, Derived>
+        operator*(Eigen::MatrixBase<Derived> const & other) const {
+            return ParallelQProduct<SparseQRType, Derived>(qr_, other.derived(), true, nthreads_);
+        }
+    private:
+        SparseQRType const & qr_;
+        int                  nthreads_;
+    };
+
+    Transpose transpose() const { return Transpose(qr_, nthreads_); }
+    Transpose adjoint() const { return Transpose(qr_, nthreads_); }
+
+    Eigen::Index rows() const { return qr_.rows(); }
+    Eigen::Index cols() const { return qr_.rows(); }
+
+private:
+    SparseQRType const & qr_;
+    int                  nthreads_;
+};
+
+template<typename SparseQRType, typename Derived>
+struct ParallelQProduct : Eigen::ReturnByValue<ParallelQProduct<SparseQRType, Derived>> {
+    ParallelQProduct(SparseQRType const & qr, Derived const & other, bool transpose, int nthreads = 0)
+        : qr_(qr), other_(other), transpose_(transpose), nthreads_(nthreads) {}
+
+    Eigen::Index rows() const { return qr_.rows(); }
+    Eigen::Index cols() const { return other_.cols(); }
+
+    template<typename Dest>
+    void evalTo(Dest & res) const {
+        using namespace Eigen;
+        eigen_assert(qr_.rows() == other_.rows() && "Non conforming object sizes");
+        Index const diagSize = (std::min)(qr_.rows(), qr_.cols());
+        Index const ncols = other_.cols();
+        bool const identity = internal::is_identity<Derived>::value;
+        res.resize(rows(), cols());
+        constexpr bool kernels = UsesHouseholderKernels<SparseQRType, decltype(res.col(0))>::value;
+        QRStats * const stats = QRStatsFor(qr_);
+        QRPhase const phase = identity ? QRPhase::QGeneration : QRPhase::QProduct;
+        {
+            QRPhaseTimer timer(stats, phase);
+            evalColumns(res, diagSize, ncols, identity, std::integral_constant<bool, kernels>());
+        }
+        // the counts depend only on the shape, so they are worked out here, after
+        // the timing and away from the threads
+        if (stats) {
+            stats->addCounts(phase, counts(ncols, identity, kernels));
+        }
+    }
+
+private:
+    // what evalColumns does: reflectors [0, end) for each column, where end
+    // follows the identity shortcut, with the kernels sharing each reflector's
+    // loads across a full group
+    QRCounts counts(Eigen::Index ncols, bool identity, bool kernels) const {
+        return QProductCounts(qr_, ncols, identity && !transpose_, kernels ? groupSize : 1);
+    }
+
+    // columns are taken in groups sharing each load of a reflector's indices and values
+    static constexpr int groupSize = 4;
+
+    template<typename Dest>
+    void evalColumns(Dest & res, Eigen::Index diagSize, Eigen::Index ncols, bool identity,
+                     std::true_type) const {
+        using namespace Eigen;
+        Index const groups = (ncols + groupSize - 1) / groupSize;
+#ifdef _OPENMP
+        int const nthreads = nthreads_ > 0 ? nthreads_ : Eigen::nbThreads();
+
+        // identity columns have very uneven costs, hence the dynamic schedule
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+#endif
+        for (Index g = 0; g < groups; g++) {
+            Index const j = g * groupSize;
+            Index const width = numext::mini(Index(groupSize), ncols - j);
+            res.middleCols(j, width) = other_.middleCols(j, width);
+            // Q * identity: column j cannot be affected by reflectors after the jth
+            // (for the group's earlier columns the extra reflectors find zero dot products)
+            Index end = (identity && !transpose_) ? numext::mini(j+width, diagSize) : diagSize;
+            if (width == groupSize) {
+                ApplyHouseholderColumns<groupSize>(qr_, &res.coeffRef(0, j), res.outerStride(),
+                                                   0, end, transpose_);
+            } else {
+                for (Index c = j; c < j + width; c++) {
+                    ApplyHouseholderColumns<1>(qr_, &res.coeffRef(0, c), 0, 0, end, transpose_);
+                }
+            }
+        }
+    }
+
+    template<typename Dest>
+    void evalColumns(Dest & res, Eigen::Index diagSize, Eigen::Index ncols, bool identity,
+                     std::false_type) const {
+        using namespace Eigen;
+#ifdef _OPENMP
+        int const nthreads = nthreads_ > 0 ? nthreads_ : Eigen::nbThreads();
+
+        // identity columns have very uneven costs, hence the dynamic schedule
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 4)
+#endif
+        for (Index j = 0; j < ncols; j++) {
+            res.col(j) = other_.col(j);
+            // Q * identity: column j cannot be affected by reflectors after the jth
+            Index end = (identity && !transpose_) ? numext::mini(j+1, diagSize) : diagSize;
+            ApplyHouseholderColumn(qr_, res.col(j), 0, end, transpose_);
+        }
+    }
+
+    SparseQRType const & qr_;
+    Derived const &      other_;
+    bool                 transpose_;   // actually adjoint, as in SparseQR
+    int                  nthreads_;    // 0 for Eigen::nbThreads()
+};
+
+#endif // PARALLEL_Q_HPP
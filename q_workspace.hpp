@@ -0,0 +1,111 @@
+// applying Q, Q' and least squares solves into caller storage, without allocating
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef Q_WORKSPACE_HPP
+#define Q_WORKSPACE_HPP
+
+#include <algorithm>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "parallel_q.hpp"
+#include "sparse_qr_access.hpp"
+
+// qr.matrixQ() * b and qr.solve(b) each return a new object, and solve()
+// makes two more temporaries internally.  For many small solves against one
+// factorization that allocation is a large part of the cost.  A QWorkspace
+// holds the one work vector a solve needs, sized when it is constructed (and
+// grown, once, if later given more right hand side columns), and writes all
+// results into storage the caller supplies - so after the first call with a
+// given shape nothing is allocated.
+// Outputs follow Eigen's convention for writable expressions: pass a matrix,
+// vector, or block of the right size.
+template<typename SparseQRType>
+struct QWorkspace {
+    using Scalar = typename SparseQRType::Scalar;
+    using StorageIndex = typename SparseQRType::StorageIndex;
+
+    explicit QWorkspace(SparseQRType const & qr, Eigen::Index rhsCols = 1)
+        : qr_(qr), work_((std::max)(qr.rows(), qr.cols()), rhsCols) {}
+
+    // y = Q * x; y may be x itself
+    template<typename Rhs, typename Dest>
+    void applyQ(Eigen::MatrixBase<Rhs> const & x, Eigen::MatrixBase<Dest> const & y) const {
+        apply(x, y, false);
+    }
+
+    // y = Q' * x (the adjoint, as in SparseQR); y may be x itself
+    template<typename Rhs, typename Dest>
+    void applyQt(Eigen::MatrixBase<Rhs> const & x, Eigen::MatrixBase<Dest> const & y) const {
+        apply(x, y, true);
+    }
+
+    // x = the least squares solution of A x = b, the same one SparseQR::solve() gives
+    template<typename Rhs, typename Dest>
+    void solve(Eigen::MatrixBase<Rhs> const & b, Eigen::MatrixBase<Dest> const & x) {
+        using namespace Eigen;
+        Dest & dest = const_cast<Dest &>(x.derived());
+        eigen_assert((b.rows() == qr_.rows()) && (dest.rows() == qr_.cols()) &&
+                     (dest.cols() == b.cols()) && "Non conforming object sizes");
+        Index const rank = qr_.rank();
+        Index const diagSize = (std::min)(qr_.rows(), qr_.cols());
+        if (work_.cols() < b.cols()) {
+            work_.resize(NoChange, b.cols());
+        }
+        auto const & R = qr_.matrixR();
+        StorageIndex const * outer = R.outerIndexPtr();
+        StorageIndex const * inner = R.innerIndexPtr();
+        Scalar const * values = R.valuePtr();
+        auto const & perm = qr_.colsPermutation().indices();
+        for (Index j = 0; j < b.cols(); j++) {
+            auto y = work_.col(j);
+            y.head(qr_.rows()) = b.col(j);
+            ApplyHouseholderColumn(qr_, y.head(qr_.rows()), 0, diagSize, true);
+            // back substitution with the leading rank x rank block of R, by columns.
+            // As Eigen's triangular solver does, we look for the diagonal from
+            // the end of each column, where factorize() puts it.
+            for (Index k = rank - 1; k >= 0; k--) {
+                StorageIndex p = outer[k+1] - 1;
+                while (inner[p] != k) {
+                    --p;
+                }
+                Scalar const yk = (y(k) /= values[p]);
+                for (StorageIndex i = outer[k]; i < outer[k+1]; i++) {
+                    if (inner[i] < k) {
+                        y(inner[i]) -= values[i] * yk;
+                    }
+                }
+            }
+            // undo the column permutation, with zeros for the dependent columns
+            for (Index i = 0; i < qr_.cols(); i++) {
+                dest(perm(i), j) = (i < rank) ? y(i) : Scalar(0);
+            }
+        }
+    }
+
+private:
+    template<typename Rhs, typename Dest>
+    void apply(Eigen::MatrixBase<Rhs> const & x, Eigen::MatrixBase<Dest> const & y, bool transpose) const {
+        using namespace Eigen;
+        Dest & dest = const_cast<Dest &>(y.derived());
+        eigen_assert((x.rows() == qr_.rows()) && (dest.rows() == qr_.rows()) &&
+                     (dest.cols() == x.cols()) && "Non conforming object sizes");
+        Index const diagSize = (std::min)(qr_.rows(), qr_.cols());
+        for (Index j = 0; j < x.cols(); j++) {
+            // the copy is elementwise, so in-place use is fine
+            dest.col(j) = x.col(j);
+            ApplyHouseholderColumn(qr_, dest.col(j), 0, diagSize, transpose);
+        }
+    }
+
+    SparseQRType const & qr_;
+    Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> work_;
+};
+
+#endif // Q_WORKSPACE_HPP
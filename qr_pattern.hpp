@@ -0,0 +1,143 @@
+// reusable symbolic analysis for sparse QR of many matrices sharing one pattern
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef QR_PATTERN_HPP
+#define QR_PATTERN_HPP
+
+#include <algorithm>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "sparse_qr_access.hpp"
+
+// SparseQR::analyzePattern computes the fill-reducing ordering and the column
+// elimination tree, but only guesses at the size of the factors (twice the
+// nonzeros of the input), so factorize() grows R and the Householder vectors
+// as it goes.  Here we also run the symbolic part of factorize() - the same
+// elimination tree traversal, without any arithmetic - to find exactly how
+// many nonzeros each factor will have, and reserve that much.  The result can
+// be installed in any number of SparseQR objects, skipping the ordering.
+//
+// That saves the ordering and the factors' growth, not every allocation:
+// factorize() still copies its input into its own permuted matrix, an O(nnz)
+// copy that frees and reallocates that matrix's per-column counts, and
+// allocates its O(m+n) work vectors afresh, on every call.  bench_ggael's
+// "QR factorize reuse" reports how many allocations that comes to.
+
+template<typename SparseQRType>
+struct QRSymbolic {
+    using PermutationType = typename SparseQRType::PermutationType;
+    using IndexVector = typename SparseQRType::IndexVector;
+
+    Eigen::Index    rows = 0, cols = 0;
+    PermutationType fillPerm;       // the fill-reducing column ordering
+    IndexVector     etree;          // column elimination tree of the permuted matrix
+    IndexVector     firstRowElt;    // first column with a nonzero in each row
+    // Predicted factor sizes.  These are exact when the matrix has full column
+    // rank; otherwise factorize() revises the tree as it finds zero pivots.
+    Eigen::Index    nnzR = 0, nnzQ = 0;
+};
+
+// the symbolic factorization: factor sizes from the pattern and the tree
+template<typename SparseQRType, typename MatrixType>
+void
+PredictFactorSizes(QRSymbolic<SparseQRType> & sym, MatrixType const & mat) {
+    using namespace Eigen;
+    using StorageIndex = typename SparseQRType::StorageIndex;
+    using QRMatrixType = typename SparseQRType::QRMatrixType;
+    // column access, as in analyzePattern
+    typename internal::conditional<MatrixType::IsRowMajor, QRMatrixType, MatrixType const &>::type cm(mat);
+
+    Index const m = sym.rows, n = sym.cols;
+    Index const diagSize = (std::min)(m, n);
+    auto const & etree = sym.etree;
+    auto const & firstRowElt = sym.firstRowElt;
+    typename SparseQRType::PermutationType const origPerm = sym.fillPerm.inverse();
+    auto const & origCol = origPerm.indices();
+
+    // As in factorize(), the same marks record both the tree nodes in the
+    // current column of R and the rows in the current Householder vector.
+    std::vector<StorageIndex> mark((std::max)(m, n), -1);
+    std::vector<StorageIndex> qOuter{0}, qInner, rNodes;
+    Index nnzR = 0;
+    for (Index col = 0; col < n; col++) {
+        Index const pivot = (std::min)(col, diagSize);   // no zero pivots
+        mark[pivot] = StorageIndex(col);
+        rNodes.clear();
+        if (pivot < diagSize) {
+            qInner.push_back(StorageIndex(pivot));
+        }
+        bool foundDiag = pivot >= m;
+        for (typename MatrixType::InnerIterator it(cm, origCol(col)); it || !foundDiag; ++it) {
+            Index const row = it ? Index(it.index()) : pivot;
+            foundDiag = foundDiag || (row == pivot);
+            for (Index st = firstRowElt(row); (st < n) && (mark[st] != col); st = etree(st)) {
+                rNodes.push_back(StorageIndex(st));
+                mark[st] = StorageIndex(col);
+            }
+            if ((row > pivot) && (mark[row] != col) && (pivot < diagSize)) {
+                qInner.push_back(StorageIndex(row));
+                mark[row] = StorageIndex(col);
+            }
+        }
+        for (StorageIndex k : rNodes) {
+            if (k >= pivot) {
+                continue;   // reflectors not yet computed contribute nothing
+            }
+            nnzR++;
+            // fill from earlier reflectors whose parent is this column
+            if ((etree(k) == pivot) && (pivot < diagSize)) {
+                for (StorageIndex p = qOuter[k]; p < qOuter[k+1]; p++) {
+                    if (mark[qInner[p]] != col) {
+                        qInner.push_back(qInner[p]);
+                        mark[qInner[p]] = StorageIndex(col);
+                    }
+                }
+            }
+        }
+        if (pivot < diagSize) {
+            nnzR++;         // the diagonal
+            qOuter.push_back(StorageIndex(qInner.size()));
+        }
+    }
+    sym.nnzR = nnzR;
+    sym.nnzQ = Index(qInner.size());
+}
+
+// Analyze the pattern of mat for qr, as analyzePattern() does, and also reserve
+// exactly the storage factorize() will need.  The returned analysis can be
+// reused for other SparseQR objects with ReuseAnalysis.
+template<typename SparseQRType, typename MatrixType>
+QRSymbolic<SparseQRType>
+AnalyzeQR(SparseQRType & qr, MatrixType const & mat) {
+    using Access = SparseQRAccess<SparseQRType>;
+    qr.analyzePattern(mat);
+    QRSymbolic<SparseQRType> sym;
+    sym.rows = mat.rows();
+    sym.cols = mat.cols();
+    sym.fillPerm = Access::fillPermutation(qr);
+    sym.etree = Access::eliminationTree(qr);
+    sym.firstRowElt = Access::firstRowElements(qr);
+    PredictFactorSizes(sym, mat);
+    Access::reserveFactors(qr, sym.nnzR, sym.nnzQ);
+    return sym;
+}
+
+// Prepare qr to factorize matrices with the pattern analyzed by AnalyzeQR,
+// without recomputing the ordering or the elimination tree
+template<typename SparseQRType>
+void
+ReuseAnalysis(SparseQRType & qr, QRSymbolic<SparseQRType> const & sym) {
+    using Access = SparseQRAccess<SparseQRType>;
+    Access::restoreAnalysis(qr, sym.rows, sym.cols, sym.fillPerm, sym.etree, sym.firstRowElt);
+    Access::reserveFactors(qr, sym.nnzR, sym.nnzQ);
+}
+
+#endif // QR_PATTERN_HPP
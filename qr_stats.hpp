@@ -0,0 +1,331 @@
+// opt-in statistics on sparse QR factorizations and Q evaluations
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef QR_STATS_HPP
+#define QR_STATS_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "sparse_qr_access.hpp"
+
+// Wall time alone cannot say which part of a QR workload changed.  These
+// statistics split it into phases, each with its time and a count of the
+// reflector work done:
+//   Ordering       analyzePattern(): the fill-reducing ordering and elimination tree
+//   Factorization  factorize()
+//   QGeneration    Q times the identity (or unit vectors), where the reflectors
+//                  after the jth cannot affect column j and are skipped
+//   QProduct       Q or Q' times a general matrix
+// Flops and bytes are estimates from a simple model of each reflector
+// application: a sparse dot product and update over the reflector's nonzeros,
+// 4 flops per nonzero per column, with the reflector's values and indices
+// read once per group of columns sharing it and each touched column entry
+// read twice and written once.  Cache reuse is not modelled, so the bytes
+// are an upper bound on memory traffic.
+// Reflectors not applied to a column are counted by reason: "skipped" by the
+// identity shortcut (those after the jth, for Q e_j), or "unreached" because
+// the column is known to have no entries where they act.
+//
+// Collection is opt-in and costs one null test per column group when off.
+// The Q evaluations of this repo (ParallelHouseholderQ, SparseQ and ThinQ)
+// record into the QRStats made active on the calling thread by a
+// CollectQRStats scope; an InstrumentedQR times its own factorization, counts
+// its work on request, and records Q evaluations on it when no scope is active.
+
+enum class QRPhase { Ordering, Factorization, QGeneration, QProduct };
+constexpr int QRPhaseCount = 4;
+
+inline char const *
+QRPhaseName(QRPhase phase) {
+    switch (phase) {
+    case QRPhase::Ordering:      return "ordering";
+    case QRPhase::Factorization: return "factorization";
+    case QRPhase::QGeneration:   return "Q generation";
+    default:                     return "Q product";
+    }
+}
+
+// the reflector work of one phase
+struct QRCounts {
+    long long reflectorsApplied = 0;    // reflector-column pairs
+    long long reflectorsSkipped = 0;    // by the identity shortcut
+    long long reflectorsUnreached = 0;  // not reaching the column
+    long long nonzerosTouched = 0;
+    double    flops = 0;
+    double    bytes = 0;
+
+    // reflectors with nnz nonzeros between them, applied to a group of columns
+    void apply(long long reflectors, long long nnz, long long columns,
+               std::size_t scalarSize, std::size_t indexSize) {
+        reflectorsApplied += reflectors * columns;
+        nonzerosTouched += 2 * nnz * columns;
+        flops += 4.0 * double(nnz) * double(columns);
+        bytes += double(nnz) * double(scalarSize + indexSize) +
+            3.0 * double(nnz) * double(columns) * double(scalarSize);
+    }
+
+    void skip(long long reflectors, long long columns) {
+        reflectorsSkipped += reflectors * columns;
+    }
+
+    void unreached(long long reflectors, long long columns) {
+        reflectorsUnreached += reflectors * columns;
+    }
+
+    // the same work repeated, as for a benchmark's iterations
+    QRCounts & operator*=(long long times) {
+        reflectorsApplied *= times;
+        reflectorsSkipped *= times;
+        reflectorsUnreached *= times;
+        nonzerosTouched *= times;
+        flops *= double(times);
+        bytes *= double(times);
+        return *this;
+    }
+
+    QRCounts & operator+=(QRCounts const & other) {
+        reflectorsApplied += other.reflectorsApplied;
+        reflectorsSkipped += other.reflectorsSkipped;
+        reflectorsUnreached += other.reflectorsUnreached;
+        nonzerosTouched += other.nonzerosTouched;
+        flops += other.flops;
+        bytes += other.bytes;
+        return *this;
+    }
+};
+
+// Accumulated times and counts, per phase.  Safe to add to from several
+// threads at once.
+struct QRStats {
+    QRStats() = default;
+    QRStats(QRStats const &) = delete;
+    QRStats & operator=(QRStats const &) = delete;
+
+    // one timed run of a phase
+    void addTime(QRPhase phase, double seconds) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        seconds_[int(phase)] += seconds;
+        calls_[int(phase)]++;
+    }
+
+    void addCounts(QRPhase phase, QRCounts const & counts) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        counts_[int(phase)] += counts;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int p = 0; p < QRPhaseCount; p++) {
+            seconds_[p] = 0;
+            counts_[p] = QRCounts();
+            calls_[p] = 0;
+        }
+    }
+
+    double seconds(QRPhase phase) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return seconds_[int(phase)];
+    }
+
+    // how many times the phase was timed
+    long calls(QRPhase phase) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return calls_[int(phase)];
+    }
+
+    QRCounts counts(QRPhase phase) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return counts_[int(phase)];
+    }
+
+    QRCounts total() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        QRCounts result;
+        for (int p = 0; p < QRPhaseCount; p++) {
+            result += counts_[p];
+        }
+        return result;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    double             seconds_[QRPhaseCount] = {};
+    QRCounts           counts_[QRPhaseCount];
+    long               calls_[QRPhaseCount] = {};
+};
+
+// the statistics being collected on this thread, if any
+inline QRStats * &
+ActiveQRStats() {
+    static thread_local QRStats * active = nullptr;
+    return active;
+}
+
+// collect statistics into stats for the lifetime of this object (on this
+// thread; evaluations that use more threads report from the calling one)
+struct CollectQRStats {
+    explicit CollectQRStats(QRStats & stats) : previous_(ActiveQRStats()) {
+        ActiveQRStats() = &stats;
+    }
+    CollectQRStats(CollectQRStats const &) = delete;
+    CollectQRStats & operator=(CollectQRStats const &) = delete;
+    ~CollectQRStats() { ActiveQRStats() = previous_; }
+private:
+    QRStats * previous_;
+};
+
+// times one phase, adding it to stats (if not null) on destruction
+struct QRPhaseTimer {
+    QRPhaseTimer(QRStats * stats, QRPhase phase)
+        : stats_(stats), phase_(phase), start_(std::chrono::steady_clock::now()) {}
+    QRPhaseTimer(QRPhaseTimer const &) = delete;
+    QRPhaseTimer & operator=(QRPhaseTimer const &) = delete;
+    ~QRPhaseTimer() {
+        if (stats_) {
+            stats_->addTime(phase_, std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count());
+        }
+    }
+private:
+    QRStats *                             stats_;
+    QRPhase                               phase_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// total nonzeros of Householder vectors [begin, end)
+template<typename SparseQRType>
+long long
+ReflectorNonZeros(SparseQRType const & qr, Eigen::Index begin, Eigen::Index end) {
+    auto const & vecs = HouseholderVectors(qr);
+    if (end <= begin) {
+        return 0;
+    }
+    if (vecs.isCompressed()) {
+        return vecs.outerIndexPtr()[end] - vecs.outerIndexPtr()[begin];
+    }
+    long long nnz = 0;
+    for (Eigen::Index k = begin; k < end; k++) {
+        nnz += vecs.innerNonZeroPtr()[k];
+    }
+    return nnz;
+}
+
+// The work of Q (or Q') times ncols columns when reflectors [0, diagSize) are
+// applied to every column, or, with identityShortcut, only [0, j] to column j.
+// Columns are taken width at a time, each group sharing the loads of a
+// reflector; width 1 is SparseQR's own product.  This depends only on the
+// shape, so it can be worked out once, away from the timed code.
+template<typename SparseQRType>
+QRCounts
+QProductCounts(SparseQRType const & qr, Eigen::Index ncols, bool identityShortcut,
+               Eigen::Index width = 1) {
+    using namespace Eigen;
+    QRCounts result;
+    std::size_t const scalarSize = sizeof(typename SparseQRType::Scalar);
+    std::size_t const indexSize = sizeof(typename SparseQRType::StorageIndex);
+    Index const diagSize = (std::min)(qr.rows(), qr.cols());
+    // nonzeros of reflectors [0, k), for every k
+    std::vector<long long> nnz(diagSize + 1, 0);
+    for (Index k = 0; k < diagSize; k++) {
+        nnz[k + 1] = nnz[k] + ReflectorNonZeros(qr, k, k + 1);
+    }
+    for (Index j = 0; j < ncols; j += width) {
+        Index const columns = (std::min)(width, ncols - j);
+        Index const end = identityShortcut ? (std::min)(j + columns, diagSize) : diagSize;
+        if (columns == width) {
+            result.apply(end, nnz[end], columns, scalarSize, indexSize);
+        } else {
+            for (Index c = 0; c < columns; c++) {
+                result.apply(end, nnz[end], 1, scalarSize, indexSize);
+            }
+        }
+        result.skip(diagSize - end, columns);
+    }
+    return result;
+}
+
+// A SparseQR that times its own analysis and factorizations, and keeps
+// statistics on Q evaluations using it outside any CollectQRStats scope.
+// It is a SparseQR, so everything taking one takes this, but only calls made
+// through the InstrumentedQR itself are recorded.  The factorization counts
+// are left out of the timed calls, which only add their times; they come
+// from the factors, on request, since factorize() applies reflector i to
+// column j exactly when R has an entry above the diagonal at (i, j), and
+// forms each reflector from its own nonzeros.
+template<typename SparseQRType>
+struct InstrumentedQR : SparseQRType {
+    using MatrixType = typename SparseQRType::MatrixType;
+
+    InstrumentedQR() = default;
+    explicit InstrumentedQR(MatrixType const & mat) { compute(mat); }
+
+    void compute(MatrixType const & mat) {
+        analyzePattern(mat);
+        factorize(mat);
+    }
+
+    void analyzePattern(MatrixType const & mat) {
+        QRPhaseTimer timer(&stats_, QRPhase::Ordering);
+        SparseQRType::analyzePattern(mat);
+    }
+
+    void factorize(MatrixType const & mat) {
+        QRPhaseTimer timer(&stats_, QRPhase::Factorization);
+        SparseQRType::factorize(mat);
+    }
+
+    // the work of the last factorization, O(nnz(R)) to count
+    QRCounts factorizationCounts() const {
+        using namespace Eigen;
+        QRCounts counts;
+        std::size_t const scalarSize = sizeof(typename SparseQRType::Scalar);
+        std::size_t const indexSize = sizeof(typename SparseQRType::StorageIndex);
+        Index const rank = this->rank();
+        auto const & R = this->matrixR();
+        for (Index j = 0; j < R.outerSize(); j++) {
+            for (typename SparseQRType::QRMatrixType::InnerIterator it(R, j); it; ++it) {
+                if (it.row() < (std::min)(j, rank)) {
+                    counts.apply(1, ReflectorNonZeros(*this, it.row(), it.row() + 1), 1, scalarSize, indexSize);
+                }
+            }
+        }
+        // forming each reflector: its norm, then scaling it
+        long long const nnzQ = ReflectorNonZeros(*this, 0, rank);
+        counts.flops += 3.0 * double(nnzQ);
+        counts.nonzerosTouched += 2 * nnzQ;
+        counts.bytes += 3.0 * double(nnzQ) * double(scalarSize);
+        return counts;
+    }
+
+    QRStats & stats() const { return stats_; }
+
+private:
+    mutable QRStats stats_;
+};
+
+// where a Q evaluation using qr should record: the active scope's statistics,
+// or for an InstrumentedQR its own
+template<typename SparseQRType>
+QRStats *
+QRStatsFor(SparseQRType const &) {
+    return ActiveQRStats();
+}
+
+template<typename SparseQRType>
+QRStats *
+QRStatsFor(InstrumentedQR<SparseQRType> const & qr) {
+    return ActiveQRStats() ? ActiveQRStats() : &qr.stats();
+}
+
+#endif // QR_STATS_HPP
@@ -0,0 +1,56 @@
+// reporting QR statistics as Google Benchmark counters
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef QR_STATS_COUNTERS_HPP
+#define QR_STATS_COUNTERS_HPP
+
+#include <benchmark/benchmark.h>
+
+#include "qr_stats.hpp"
+
+// Statistics collected over a benchmark's timing loop, as counters: seconds
+// per iteration in each phase that ran, reflector applications, skips (by the
+// identity shortcut) and reflectors not reaching their columns, and
+// nonzeros touched per iteration, and flops and bytes as rates over the
+// benchmark's time (so GFLOP/s and effective bandwidth).
+inline void
+SetQRStatsCounters(benchmark::State & state, QRStats const & stats) {
+    using benchmark::Counter;
+    static char const * const timeNames[QRPhaseCount] = {"orderTime", "factorTime", "qGenTime", "qProdTime"};
+    for (int p = 0; p < QRPhaseCount; p++) {
+        if (stats.calls(QRPhase(p)) > 0) {
+            state.counters[timeNames[p]] = Counter(stats.seconds(QRPhase(p)), Counter::kAvgIterations);
+        }
+    }
+    QRCounts const total = stats.total();
+    state.counters["applied"] = Counter(double(total.reflectorsApplied), Counter::kAvgIterations);
+    state.counters["skipped"] = Counter(double(total.reflectorsSkipped), Counter::kAvgIterations);
+    state.counters["unreached"] = Counter(double(total.reflectorsUnreached), Counter::kAvgIterations);
+    state.counters["nnzTouched"] = Counter(double(total.nonzerosTouched), Counter::kAvgIterations);
+    state.counters["flops"] = Counter(total.flops, Counter::kIsRate);
+    state.counters["bytes"] = Counter(total.bytes, Counter::kIsRate);
+}
+
+// Add counts, the work of one iteration, to stats as if recorded on each of
+// the benchmark's iterations.  For work counted once, after the timing loop.
+inline void
+AddIterationCounts(benchmark::State const & state, QRStats & stats, QRPhase phase, QRCounts counts) {
+    counts *= state.iterations();
+    stats.addCounts(phase, counts);
+}
+
+// counters for products that record nothing themselves, like SparseQR's own
+// matrixQ(), from the work of one iteration (see QProductCounts)
+inline void
+SetQRCountsCounters(benchmark::State & state, QRPhase phase, QRCounts const & counts) {
+    QRStats stats;
+    AddIterationCounts(state, stats, phase, counts);
+    SetQRStatsCounters(state, stats);
+}
+
+#endif // QR_STATS_COUNTERS_HPP
@@ -0,0 +1,300 @@
+// appending and removing rows of a sparse QR factorization with Givens rotations
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef QR_UPDATE_HPP
+#define QR_UPDATE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "parallel_q.hpp"
+#include "sparse_qr_access.hpp"
+
+// A P = Q R, kept up to date as rows of A come and go, without refactoring.
+//
+// Rows and the coordinates Q maps from are both numbered in an extended space:
+// the original rows first, then each appended row under a new number.  Q is
+// the original Householder sequence (on the original rows) followed by every
+// Givens rotation applied since, and R is held by rows in coordinates 0..n-1;
+// every other live coordinate is a zero row of [R; 0].
+//
+// Appending row a gives it a fresh row and coordinate t, then rotates R's
+// rows against it, left to right, until row t of [R; 0] is zero again.
+// Removing row i computes q = Q' e_i, folds q's weight outside R into one
+// coordinate p (rotations there leave R alone), then rotates R's rows into p
+// from the bottom up.  That leaves R upper triangular, row i of Q equal to
+// e_p', and column p of Q equal to e_i, so row i and coordinate p are retired
+// together.  Either way, rotations are only ever appended to Q.
+//
+// Requires full column rank, and at least as many rows as columns; a row whose
+// removal would leave A rank deficient is refused.  Each removal adds up to
+// one rotation per live coordinate, and every later removal replays them all,
+// so the cost of an update grows with the number made.  For long-running use,
+// refactor the current rows when refactorAdvised() says so.
+template<typename SparseQRType>
+struct QRUpdate {
+    using Scalar = typename SparseQRType::Scalar;
+    using StorageIndex = typename SparseQRType::StorageIndex;
+    using RowType = Eigen::SparseVector<Scalar, Eigen::RowMajor, StorageIndex>;
+    using SparseMatrixType = Eigen::SparseMatrix<Scalar, Eigen::ColMajor, StorageIndex>;
+    using PermutationType = typename SparseQRType::PermutationType;
+    using VectorType = Eigen::Matrix<Scalar, Eigen::Dynamic, 1>;
+
+    explicit QRUpdate(SparseQRType const & qr)
+        : qr_(qr), baseRows_(qr.rows()), rowIds_(qr.rows()),
+          liveRow_(qr.rows(), true), liveCoord_(qr.rows(), true) {
+        using namespace Eigen;
+        eigen_assert((qr.rank() == qr.cols()) && (qr.rows() >= qr.cols()) &&
+                     "row updates need a full column rank factorization");
+        for (Index i = 0; i < qr.rows(); i++) {
+            rowIds_[i] = i;
+        }
+        SparseMatrix<Scalar, RowMajor, StorageIndex> R = qr.matrixR().topRows(qr.cols());
+        rRows_.resize(qr.cols());
+        for (Index k = 0; k < qr.cols(); k++) {
+            rRows_[k] = R.row(k);
+        }
+    }
+
+    // append a row (in A's own column order); returns its row number
+    Eigen::Index appendRow(RowType const & row) {
+        using namespace Eigen;
+        eigen_assert(row.size() == cols() && "Non conforming object sizes");
+        Index const t = Index(liveRow_.size());
+        liveRow_.push_back(true);
+        liveCoord_.push_back(true);
+        rowIds_.push_back(t);
+        // move the row into R's column order
+        RowType w(cols());
+        PermutationType const & perm = qr_.colsPermutation();
+        PermutationType const inv = perm.inverse();
+        std::vector<std::pair<StorageIndex, Scalar>> entries;
+        for (typename RowType::InnerIterator it(row); it; ++it) {
+            entries.emplace_back(StorageIndex(inv.indices()(it.index())), it.value());
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [](std::pair<StorageIndex, Scalar> const & a, std::pair<StorageIndex, Scalar> const & b) {
+                      return a.first < b.first;
+                  });
+        w.reserve(Index(entries.size()));
+        for (auto const & e : entries) {
+            w.insertBack(e.first) = e.second;
+        }
+        // rotate it into R, leftmost entry first; each rotation zeroes that entry
+        // and can only fill in to its right
+        while (w.nonZeros() > 0) {
+            Index const k = w.innerIndexPtr()[0];
+            Scalar const wk = w.valuePtr()[0];
+            Scalar const rkk = rRows_[k].coeff(k);
+            Scalar const r = std::hypot(rkk, wk);
+            Scalar const c = rkk / r, s = wk / r;
+            rotate(rRows_[k], w, c, s, k);
+            rotations_.push_back(Rotation{StorageIndex(k), StorageIndex(t), c, s});
+        }
+        return t;
+    }
+
+    // remove a row by its number; false if it is not a current row or removing
+    // it would lose full column rank
+    bool removeRow(Eigen::Index id) {
+        using namespace Eigen;
+        Index const n = cols();
+        if ((id < 0) || (id >= extendedRows()) || !liveRow_[id] || (rows() <= n)) {
+            return false;
+        }
+        VectorType q = VectorType::Zero(extendedRows());
+        q(id) = Scalar(1);
+        applyQt(q);
+        // the pivot: the coordinate outside R with the most weight
+        Index p = -1;
+        Scalar outside(0);
+        for (Index c = n; c < extendedRows(); c++) {
+            if (liveCoord_[c]) {
+                outside += q(c) * q(c);
+                if ((p < 0) || (std::abs(q(c)) > std::abs(q(p)))) {
+                    p = c;
+                }
+            }
+        }
+        // all of row i's weight in R's coordinates means A needs it for full rank
+        if ((p < 0) || (std::sqrt(outside) <= std::sqrt(Scalar(n)) * Eigen::NumTraits<Scalar>::epsilon())) {
+            return false;
+        }
+        for (Index c = n; c < extendedRows(); c++) {
+            if (liveCoord_[c] && (c != p) && (q(c) != Scalar(0))) {
+                zeroCoordinate(q, c, p);
+            }
+        }
+        // R's rows, bottom to top: row p picks up entries no further left than
+        // the row it is rotated with, so R stays triangular
+        RowType rp(n);
+        for (Index k = n - 1; k >= 0; k--) {
+            if (q(k) != Scalar(0)) {
+                Rotation const g = zeroCoordinate(q, k, p);
+                rotate(rRows_[k], rp, g.c, g.s, -1);
+            }
+        }
+        liveRow_[id] = false;
+        liveCoord_[p] = false;
+        rowIds_.erase(std::find(rowIds_.begin(), rowIds_.end(), StorageIndex(id)));
+        return true;
+    }
+
+    // the current rows of A, in order, by row number
+    std::vector<StorageIndex> const & rowIds() const { return rowIds_; }
+
+    Eigen::Index rows() const { return Eigen::Index(rowIds_.size()); }
+    Eigen::Index cols() const { return qr_.cols(); }
+    // the size of the space row numbers and Q live in, retired ones included
+    Eigen::Index extendedRows() const { return Eigen::Index(liveRow_.size()); }
+    std::size_t rotations() const { return rotations_.size(); }
+
+    // True once replaying the rotations costs more than the Householder
+    // reflectors they follow (about 6 flops per rotation against 4 per
+    // reflector nonzero), i.e. applying Q - and so each removal - has at least
+    // doubled in cost since the factorization.
+    bool refactorAdvised() const {
+        return 6.0 * double(rotations_.size()) > 4.0 * double(HouseholderVectors(qr_).nonZeros());
+    }
+
+    // the current (square, upper triangular) R
+    SparseMatrixType matrixR() const {
+        using namespace Eigen;
+        std::vector<Triplet<Scalar, StorageIndex>> triplets;
+        for (Index k = 0; k < cols(); k++) {
+            for (typename RowType::InnerIterator it(rRows_[k]); it; ++it) {
+                triplets.emplace_back(StorageIndex(k), it.index(), it.value());
+            }
+        }
+        SparseMatrixType R(cols(), cols());
+        R.setFromTriplets(triplets.begin(), triplets.end());
+        return R;
+    }
+
+    PermutationType const & colsPermutation() const { return qr_.colsPermutation(); }
+
+    // x = Q x, in place; x has extendedRows() rows, indexed by coordinate going
+    // in and by row number coming out
+    template<typename Derived>
+    void applyQ(Eigen::MatrixBase<Derived> const & x) const {
+        using namespace Eigen;
+        Derived & dest = const_cast<Derived &>(x.derived());
+        eigen_assert((dest.rows() == extendedRows()) && "Non conforming object sizes");
+        Index const diagSize = (std::min)(qr_.rows(), qr_.cols());
+        for (Index j = 0; j < dest.cols(); j++) {
+            for (auto g = rotations_.rbegin(); g != rotations_.rend(); ++g) {
+                Scalar const xa = dest(g->a, j), xb = dest(g->b, j);
+                dest(g->a, j) = g->c * xa - g->s * xb;
+                dest(g->b, j) = g->s * xa + g->c * xb;
+            }
+            ApplyHouseholderColumn(qr_, dest.col(j).head(baseRows_), 0, diagSize, false);
+        }
+    }
+
+    // y = Q' y, in place; the reverse of applyQ
+    template<typename Derived>
+    void applyQt(Eigen::MatrixBase<Derived> const & y) const {
+        using namespace Eigen;
+        Derived & dest = const_cast<Derived &>(y.derived());
+        eigen_assert((dest.rows() == extendedRows()) && "Non conforming object sizes");
+        Index const diagSize = (std::min)(qr_.rows(), qr_.cols());
+        for (Index j = 0; j < dest.cols(); j++) {
+            ApplyHouseholderColumn(qr_, dest.col(j).head(baseRows_), 0, diagSize, true);
+            for (Rotation const & g : rotations_) {
+                Scalar const ya = dest(g.a, j), yb = dest(g.b, j);
+                dest(g.a, j) =  g.c * ya + g.s * yb;
+                dest(g.b, j) = -g.s * ya + g.c * yb;
+            }
+        }
+    }
+
+    // the least squares solution for the current rows; b is in rowIds() order
+    VectorType solve(VectorType const & b) const {
+        using namespace Eigen;
+        eigen_assert((b.size() == rows()) && "Non conforming object sizes");
+        VectorType y = VectorType::Zero(extendedRows());
+        for (Index i = 0; i < rows(); i++) {
+            y(rowIds_[i]) = b(i);
+        }
+        applyQt(y);
+        // back substitution by rows; the diagonal leads each one
+        VectorType x(cols());
+        for (Index k = cols() - 1; k >= 0; k--) {
+            Scalar sum = y(k);
+            typename RowType::InnerIterator it(rRows_[k]);
+            Scalar const diag = it.value();
+            for (++it; it; ++it) {
+                sum -= it.value() * x(it.index());
+            }
+            x(k) = sum / diag;
+        }
+        return qr_.colsPermutation() * x;
+    }
+
+private:
+    struct Rotation {
+        StorageIndex a, b;      // coordinates: [R; 0] rows a and b go to (c a + s b, c b - s a)
+        Scalar c, s;
+    };
+
+    // record the rotation of coordinates (k, p) zeroing q(k) into q(p)
+    Rotation zeroCoordinate(VectorType & q, Eigen::Index k, Eigen::Index p) {
+        Scalar const r = std::hypot(q(k), q(p));
+        Rotation const g{StorageIndex(k), StorageIndex(p), q(p) / r, -q(k) / r};
+        q(k) = Scalar(0);
+        q(p) = r;
+        rotations_.push_back(g);
+        return g;
+    }
+
+    // a = c a + s b, b = c b - s a, leaving out b's entry at drop (the one the
+    // rotation zeroes, when there is one)
+    void rotate(RowType & a, RowType & b, Scalar c, Scalar s, Eigen::Index drop) {
+        using namespace Eigen;
+        RowType na(a.size()), nb(b.size());
+        na.reserve(a.nonZeros() + b.nonZeros());
+        nb.reserve(a.nonZeros() + b.nonZeros());
+        typename RowType::InnerIterator ia(a), ib(b);
+        while (ia || ib) {
+            Index j;
+            Scalar va(0), vb(0);
+            if (ia && (!ib || (ia.index() <= ib.index()))) {
+                j = ia.index();
+                va = ia.value();
+                if (ib && (ib.index() == j)) {
+                    vb = ib.value();
+                    ++ib;
+                }
+                ++ia;
+            } else {
+                j = ib.index();
+                vb = ib.value();
+                ++ib;
+            }
+            na.insertBack(j) = c * va + s * vb;
+            if (j != drop) {
+                nb.insertBack(j) = c * vb - s * va;
+            }
+        }
+        a.swap(na);
+        b.swap(nb);
+    }
+
+    SparseQRType const &      qr_;
+    Eigen::Index              baseRows_;     // rows of the original factorization
+    std::vector<StorageIndex> rowIds_;
+    std::vector<bool>         liveRow_, liveCoord_;
+    std::vector<RowType>      rRows_;
+    std::vector<Rotation>     rotations_;
+};
+
+#endif // QR_UPDATE_HPP
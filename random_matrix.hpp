@@ -9,30 +9,92 @@
 #ifndef RANDOM_MATRIX_HPP
 #define RANDOM_MATRIX_HPP
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
 #include <random>
+#include <string>
+#include <tuple>
+#include <vector>
 #include <Eigen/Sparse>
+#include <Eigen/SparseQR>
 
+#include "binary_io.hpp"
+
+// Options for RandomMatrixOfSize: by default empty rows and columns may occur
+// (as they would from independent draws), but e.g. SparseQR cannot handle empty rows
+enum EmptyLines {
+    AllowEmpty        = 0,
+    NoEmptyRows       = 1,
+    NoEmptyCols       = 2,
+    NoEmptyRowsOrCols = NoEmptyRows | NoEmptyCols
+};
+
+// Each entry is independently nonzero with probability "density".  Rather than
+// drawing for every entry we draw the (geometrically distributed) gaps between
+// successive nonzeros in column-major order, so the cost is proportional to the
+// number of nonzeros and not to rows*cols.
+// The result always has at least one nonzero, unless it has no rows or columns.
 template<typename Float>
 Eigen::SparseMatrix<Float>
 RandomMatrixOfSize(std::default_random_engine & gen,
              Eigen::Index rows,
              Eigen::Index cols,
-             float density) {
+             float density,
+             EmptyLines empty = AllowEmpty) {
     using namespace Eigen;
+    // nothing to place, and no valid range to draw positions from
+    if ((rows == 0) || (cols == 0)) {
+        return SparseMatrix<Float>(rows, cols);
+    }
     std::vector<Triplet<Float>> tripletList;
     std::uniform_real_distribution<Float> dist(0.0,1.0);
-    for (Index i = 0; i < rows; i++) {
+    std::vector<bool> rowUsed(rows, false), colUsed(cols, false);
+    auto addEntry = [&](Index i, Index j) {
+        tripletList.emplace_back(i, j, 10 * dist(gen));
+        rowUsed[i] = true;
+        colUsed[j] = true;
+    };
+
+    long long const total = (long long)rows * cols;
+    if (density >= 1) {
+        tripletList.reserve(total);
+        for (long long pos = 0; pos < total; pos++) {
+            addEntry(pos % rows, pos / rows);
+        }
+    } else if (density > 0) {
+        tripletList.reserve((std::size_t)(1.1 * density * total) + 16);
+        std::geometric_distribution<long long> skip(density);
+        for (long long pos = skip(gen); pos < total; pos += skip(gen) + 1) {
+            addEntry(pos % rows, pos / rows);
+        }
+    }
+
+    // patch up any lines we were asked not to leave empty
+    if (empty & NoEmptyRows) {
+        std::uniform_int_distribution<Index> anyCol(0, cols-1);
+        for (Index i = 0; i < rows; i++) {
+            if (!rowUsed[i]) {
+                addEntry(i, anyCol(gen));
+            }
+        }
+    }
+    if (empty & NoEmptyCols) {
+        std::uniform_int_distribution<Index> anyRow(0, rows-1);
         for (Index j = 0; j < cols; j++) {
-            // get a random number between 0 and 1
-            if (dist(gen) < density) {
-                // populate this entry
-                tripletList.emplace_back(i, j, 10 * dist(gen));
+            if (!colUsed[j]) {
+                addEntry(anyRow(gen), j);
             }
         }
     }
     if (tripletList.empty()) {
-        // try again
-        return RandomMatrixOfSize<Float>(gen, rows, cols, density);
+        // rather than try again, place a single entry
+        addEntry(std::uniform_int_distribution<Index>(0, rows-1)(gen),
+                 std::uniform_int_distribution<Index>(0, cols-1)(gen));
     }
 
     SparseMatrix<Float> mat(rows, cols);
@@ -44,12 +106,13 @@ template<typename Float>
 Eigen::SparseMatrix<Float>
 RandomMatrix(std::default_random_engine & gen,
              Eigen::Index max_dim,
-             float density) {
+             float density,
+             EmptyLines empty = AllowEmpty) {
     using namespace Eigen;
     std::uniform_int_distribution<Eigen::Index> dim(1, max_dim);
     Index x = dim(gen);
     Index y = dim(gen);
-    return RandomMatrixOfSize<Float>(gen, x, y, density);
+    return RandomMatrixOfSize<Float>(gen, x, y, density, empty);
 }
 
 template<typename Float>
@@ -70,23 +133,242 @@ RandomMatrixProduct(std::default_random_engine & gen,
                           RandomMatrixOfSize<Float>(gen, c1r2, c2, density));
 }
 
+// Structural (pattern only) facts about a sparse matrix.  The counts are
+// gathered in a single pass over its storage.
+struct MatrixStructure {
+    std::vector<Eigen::Index> rowCounts;   // nonzeros in each row
+    std::vector<Eigen::Index> colCounts;   // nonzeros in each column
+    Eigen::Index emptyRows = 0;
+    Eigen::Index emptyCols = 0;
+    // The structural rank: the size of a maximum matching between rows and
+    // columns through nonzeros (a maximum transversal).  It is the largest rank
+    // any values on this pattern can give, so it bounds the numerical rank from
+    // above, and a matrix with structural rank below min(rows, cols) is singular
+    // whatever its values.
+    Eigen::Index structuralRank = 0;
+};
+
+// The matching starts from a greedy one made during the counting pass, then
+// grows it by Hopcroft-Karp: each phase finds, with one breadth first pass,
+// the length of the shortest augmenting paths, then augments along a maximal
+// set of them with depth first searches that never retry a line.  A phase
+// costs O(nnz), and there are at most O(sqrt(lines)) of them, so no exact
+// structural rank costs less in the worst case; on random patterns the greedy
+// matching leaves little to do and a phase or two finishes it.
+template<typename SparseMatrixType>
+MatrixStructure
+AnalyzeStructure(SparseMatrixType const & mat) {
+    using namespace Eigen;
+    MatrixStructure result;
+    result.rowCounts.assign(mat.rows(), 0);
+    result.colCounts.assign(mat.cols(), 0);
+    // the pattern by outer index, for the augmenting path searches
+    std::vector<Index> start(mat.outerSize() + 1, 0), adjacent;
+    adjacent.reserve(mat.nonZeros());
+    std::vector<Index> outerMate(mat.outerSize(), -1), innerMate(mat.innerSize(), -1);
+    for (Index outer = 0; outer < mat.outerSize(); outer++) {
+        for (typename SparseMatrixType::InnerIterator it(mat, outer); it; ++it) {
+            result.rowCounts[it.row()]++;
+            result.colCounts[it.col()]++;
+            adjacent.push_back(it.index());
+            if ((outerMate[outer] < 0) && (innerMate[it.index()] < 0)) {
+                outerMate[outer] = it.index();
+                innerMate[it.index()] = outer;
+                result.structuralRank++;
+            }
+        }
+        start[outer + 1] = Index(adjacent.size());
+    }
+    result.emptyRows = std::count(result.rowCounts.begin(), result.rowCounts.end(), 0);
+    result.emptyCols = std::count(result.colCounts.begin(), result.colCounts.end(), 0);
+
+    // Each search keeps a path of outer lines, each (but the first) the mate of
+    // the inner line the previous one is trying, and one layer further from the
+    // unmatched outer lines; reaching an unmatched inner line at the shortest
+    // augmenting distance shifts every mate along the path
+    Index const unreached = std::numeric_limits<Index>::max();
+    std::vector<Index> layer(mat.outerSize()), next(mat.outerSize()), queue, path;
+    while (true) {
+        queue.clear();
+        for (Index outer = 0; outer < mat.outerSize(); outer++) {
+            layer[outer] = (outerMate[outer] < 0) ? 0 : unreached;
+            if (outerMate[outer] < 0) {
+                queue.push_back(outer);
+            }
+        }
+        Index shortest = unreached;     // layer of the outer lines ending shortest paths
+        for (std::size_t head = 0; (head < queue.size()) && (layer[queue[head]] < shortest); head++) {
+            Index const outer = queue[head];
+            for (Index k = start[outer]; k < start[outer + 1]; k++) {
+                Index const mate = innerMate[adjacent[k]];
+                if (mate < 0) {
+                    shortest = layer[outer];
+                } else if (layer[mate] == unreached) {
+                    layer[mate] = layer[outer] + 1;
+                    queue.push_back(mate);
+                }
+            }
+        }
+        if (shortest == unreached) {
+            break;
+        }
+
+        std::copy(start.begin(), start.end() - 1, next.begin());
+        for (Index root = 0; root < mat.outerSize(); root++) {
+            if (outerMate[root] >= 0) {
+                continue;
+            }
+            path.assign(1, root);
+            while (!path.empty()) {
+                Index const outer = path.back();
+                if (next[outer] == start[outer + 1]) {
+                    layer[outer] = unreached;       // a dead end for the rest of the phase
+                    path.pop_back();
+                    continue;
+                }
+                Index const inner = adjacent[next[outer]++];
+                Index const mate = innerMate[inner];
+                if (mate >= 0) {
+                    if ((layer[outer] < shortest) && (layer[mate] == layer[outer] + 1)) {
+                        path.push_back(mate);
+                    }
+                    continue;
+                }
+                if (layer[outer] != shortest) {
+                    continue;
+                }
+                // each outer line on the path takes the inner line it was trying
+                for (Index pathOuter : path) {
+                    Index const taken = adjacent[next[pathOuter] - 1];
+                    outerMate[pathOuter] = taken;
+                    innerMate[taken] = pathOuter;
+                }
+                result.structuralRank++;
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+// Random matrices, and their QR factorizations, cached by seed, dimensions
+// and density.  Each matrix comes from its own engine seeded from that key, so
+// a key always produces the same matrix no matter what order matrices are
+// requested in.  Given a directory, the cache also keeps matrices (and
+// optionally factorizations) there in binary form, so later runs - and other
+// builds - start quickly and compare identical inputs.
+// Matrices have no empty rows, as SparseQR requires.
 template<typename Float>
 struct MatrixCache {
-    Eigen::SparseMatrix<Float>
-    getRandomMatrix(std::default_random_engine & gen,
-                    Eigen::Index rows, Eigen::Index cols,
-                    float density) {
-        auto it = cache_.find(std::make_tuple(rows, cols, density));
+    using MatrixType = Eigen::SparseMatrix<Float>;
+    using QRType = Eigen::SparseQR<MatrixType, Eigen::COLAMDOrdering<int>>;
+
+    explicit MatrixCache(unsigned seed = 0, std::string directory = "",
+                         bool persistFactorizations = true)
+        : seed_(seed), directory_(std::move(directory)),
+          persistFactorizations_(persistFactorizations) {}
+
+    MatrixType const &
+    getRandomMatrix(Eigen::Index rows, Eigen::Index cols, float density) {
+        return entry(std::make_tuple(rows, cols, density)).matrix;
+    }
+
+    QRType const &
+    getFactorization(Eigen::Index rows, Eigen::Index cols, float density) {
+        auto key = std::make_tuple(rows, cols, density);
+        Entry & e = entry(key);
+        if (!e.qr) {
+            e.qr.reset(new QRType);
+            std::string const path = filename("qr", key);
+            // a factorization file starts with the fingerprint of the matrix it
+            // was computed from, and is only used for that matrix
+            std::uint64_t const fingerprint = SparseFingerprint(e.matrix);
+            if (!persistFactorizations_ || !load(path, [&](BinaryReader & in) {
+                        std::uint64_t const stored = in.read<std::uint64_t>();
+                        return in.ok() && (stored == fingerprint) && ReadFactorization(in, *e.qr) &&
+                            (e.qr->rows() == e.matrix.rows()) && (e.qr->cols() == e.matrix.cols());
+                    })) {
+                e.qr->compute(e.matrix);
+                if (persistFactorizations_ && (e.qr->info() == Eigen::Success)) {
+                    save(path, [&](std::ostream & out) {
+                            WriteRaw(out, &fingerprint, 1);
+                            WriteFactorization(out, *e.qr);
+                        });
+                }
+            }
+        }
+        return *e.qr;
+    }
+
+private:
+    using Key = std::tuple<Eigen::Index, Eigen::Index, float>;
+    struct Entry {
+        MatrixType              matrix;
+        std::unique_ptr<QRType> qr;
+    };
+
+    Entry & entry(Key const & key) {
+        auto it = cache_.find(key);
         if (it != cache_.end()) {
             return it->second;
-        } else {
-            it = cache_.emplace(std::make_tuple(rows, cols, density),
-                                RandomMatrixOfSize<Float>(gen, rows, cols, density)).first;
-            return it->second;
         }
+        Entry & e = cache_[key];
+        std::string const path = filename("matrix", key);
+        if (!load(path, [&](BinaryReader & in) { return ReadSparse(in, e.matrix); })) {
+            std::uint32_t densityBits;
+            float density = std::get<2>(key);
+            std::memcpy(&densityBits, &density, sizeof(densityBits));
+            std::seed_seq seq{seed_, std::uint32_t(std::get<0>(key)), std::uint32_t(std::get<1>(key)),
+                              densityBits};
+            std::default_random_engine gen(seq);
+            e.matrix = RandomMatrixOfSize<Float>(gen, std::get<0>(key), std::get<1>(key), density,
+                                                 NoEmptyRows);
+            save(path, [&](std::ostream & out) { WriteSparse(out, e.matrix); });
+        }
+        return e;
     }
-private:
-    std::map<std::tuple<Eigen::Index, Eigen::Index, float>, Eigen::SparseMatrix<Float>> cache_;
+
+    // empty if we are not keeping files
+    std::string filename(char const * kind, Key const & key) const {
+        if (directory_.empty()) {
+            return "";
+        }
+        char name[128];
+        std::snprintf(name, sizeof(name), "/%s-%zu-%u-%ldx%ld-%.9g.bin",
+                      kind, sizeof(Float), seed_,
+                      long(std::get<0>(key)), long(std::get<1>(key)), std::get<2>(key));
+        return directory_ + name;
+    }
+
+    template<typename Reader>
+    bool load(std::string const & path, Reader && reader) const {
+        if (path.empty()) {
+            return false;
+        }
+        MappedFile file(path);
+        if (!file.valid()) {
+            return false;
+        }
+        BinaryReader in(file.data(), file.size());
+        return ReadBinaryHeader<Float, typename MatrixType::StorageIndex>(in, "EQMCACHE") && reader(in);
+    }
+
+    template<typename Writer>
+    void save(std::string const & path, Writer && writer) const {
+        if (path.empty()) {
+            return;
+        }
+        WriteFileAtomically(path, [&](std::ostream & out) {
+                BinaryHeader header = MakeBinaryHeader<Float, typename MatrixType::StorageIndex>("EQMCACHE");
+                WriteRaw(out, &header, 1);
+                writer(out);
+            });
+    }
+
+    unsigned                 seed_;
+    std::string              directory_;
+    bool                     persistFactorizations_;
+    std::map<Key, Entry>     cache_;
 };
 
 #endif // RANDOM_MATRIX_HPP
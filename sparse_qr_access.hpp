@@ -0,0 +1,155 @@
+// access to the factorization internals of Eigen's SparseQR
+//
+// Copyright (C) 2017 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef SPARSE_QR_ACCESS_HPP
+#define SPARSE_QR_ACCESS_HPP
+
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+// The alternative Q code in this repo needs the Householder vectors and
+// coefficients, which SparseQR keeps protected.  Every specialization of
+// SparseQR_QProduct is a friend of SparseQR, so we borrow a partial
+// specialization of it (selected by a tag type) as our accessor.
+
+namespace Eigen {
+
+struct SparseQRInternals {};
+
+template<typename SparseQRType>
+struct SparseQR_QProduct<SparseQRType, SparseQRInternals> {
+    using QRMatrixType = typename SparseQRType::QRMatrixType;
+    using ScalarVector = typename SparseQRType::ScalarVector;
+
+    static QRMatrixType const &
+    householderVectors(SparseQRType const & qr) { return qr.m_Q; }
+
+    static ScalarVector const &
+    householderCoeffs(SparseQRType const & qr) { return qr.m_hcoeffs; }
+
+    using PermutationType = typename SparseQRType::PermutationType;
+
+    // the fill-reducing part of the column permutation
+    static PermutationType const &
+    fillPermutation(SparseQRType const & qr) { return qr.m_perm_c; }
+
+    using IndexVector = typename SparseQRType::IndexVector;
+
+    // the column elimination tree, and the first column with a nonzero in each
+    // row, as computed by analyzePattern() (both in fill-permuted order)
+    static IndexVector const &
+    eliminationTree(SparseQRType const & qr) { return qr.m_etree; }
+
+    static IndexVector const &
+    firstRowElements(SparseQRType const & qr) { return qr.m_firstRowElt; }
+
+    // Reinstate the result of analyzePattern() for a matrix of the same
+    // pattern, as if analyzePattern() had just been called on it
+    static void
+    restoreAnalysis(SparseQRType & qr, Index rows, Index cols, PermutationType const & fillPerm,
+                    IndexVector const & etree, IndexVector const & firstRowElt) {
+        Index const diagSize = (std::min)(rows, cols);
+        qr.m_perm_c = fillPerm;
+        qr.m_outputPerm_c = fillPerm.inverse();
+        qr.m_etree = etree;
+        qr.m_firstRowElt = firstRowElt;
+        qr.m_isEtreeOk = true;
+        qr.m_R.resize(rows, cols);
+        qr.m_Q.resize(rows, diagSize);
+        qr.m_hcoeffs.resize(diagSize);
+        qr.m_analysisIsok = true;
+        qr.m_factorizationIsok = false;
+    }
+
+    // whether the elimination tree is still the one for the fill-reducing order
+    // alone (factorize() revises it on finding a zero pivot)
+    static bool
+    eliminationTreeIsCurrent(SparseQRType const & qr) { return qr.m_isEtreeOk; }
+
+    using RealScalar = typename NumTraits<typename SparseQRType::Scalar>::Real;
+
+    // the pivot threshold set with setPivotThreshold(), if any
+    static bool
+    usesDefaultThreshold(SparseQRType const & qr) { return qr.m_useDefaultThreshold; }
+
+    static RealScalar
+    pivotThreshold(SparseQRType const & qr) { return qr.m_threshold; }
+
+    // Install the factors of a full column rank factorization computed outside
+    // factorize(), leaving the analysis in place for further factorizations
+    static void
+    installFactorization(SparseQRType & qr, Index rows, Index cols,
+                         QRMatrixType R, QRMatrixType Q, ScalarVector hcoeffs,
+                         IndexVector const & etree, IndexVector const & firstRowElt) {
+        qr.m_pmat.resize(rows, cols);
+        qr.m_R = std::move(R);
+        qr.m_Q = std::move(Q);
+        qr.m_hcoeffs = std::move(hcoeffs);
+        qr.m_outputPerm_c = qr.m_perm_c.inverse();
+        qr.m_pivotperm.setIdentity(cols);
+        qr.m_etree = etree;
+        qr.m_firstRowElt = firstRowElt;
+        qr.m_isEtreeOk = true;
+        qr.m_nonzeropivots = cols;
+        qr.m_isQSorted = false;
+        qr.m_factorizationIsok = true;
+        qr.m_isInitialized = true;
+        qr.m_info = Success;
+    }
+
+    // make room for this many nonzeros in R and the Householder vectors, so
+    // factorize() need not grow them as it goes
+    static void
+    reserveFactors(SparseQRType & qr, Index nnzR, Index nnzQ) {
+        qr.m_R.reserve(nnzR);
+        qr.m_Q.reserve(nnzQ);
+    }
+
+    // Reinstate a previously computed factorization, as if by factorize().
+    // Only what is needed for Q products, solves, and R is restored, so
+    // factorize() must still be preceded by analyzePattern() afterwards.
+    static void
+    restore(SparseQRType & qr, Index rows, Index cols,
+            QRMatrixType R, QRMatrixType Q, ScalarVector hcoeffs,
+            PermutationType fillPerm, PermutationType outputPerm, Index rank) {
+        qr.m_pmat.resize(rows, cols);
+        qr.m_R = std::move(R);
+        qr.m_Q = std::move(Q);
+        qr.m_hcoeffs = std::move(hcoeffs);
+        qr.m_perm_c = std::move(fillPerm);
+        qr.m_outputPerm_c = std::move(outputPerm);
+        qr.m_nonzeropivots = rank;
+        qr.m_isQSorted = false;
+        qr.m_analysisIsok = false;
+        qr.m_isEtreeOk = false;
+        qr.m_factorizationIsok = true;
+        qr.m_isInitialized = true;
+        qr.m_info = Success;
+    }
+};
+
+} // namespace Eigen
+
+template<typename SparseQRType>
+using SparseQRAccess = Eigen::SparseQR_QProduct<SparseQRType, Eigen::SparseQRInternals>;
+
+// the Householder vectors, one per column (including the implicit leading 1)
+template<typename SparseQRType>
+typename SparseQRType::QRMatrixType const &
+HouseholderVectors(SparseQRType const & qr) {
+    return SparseQRAccess<SparseQRType>::householderVectors(qr);
+}
+
+// the Householder coefficients (tau) matching HouseholderVectors
+template<typename SparseQRType>
+typename SparseQRType::ScalarVector const &
+HouseholderCoeffs(SparseQRType const & qr) {
+    return SparseQRAccess<SparseQRType>::householderCoeffs(qr);
+}
+
+#endif // SPARSE_QR_ACCESS_HPP
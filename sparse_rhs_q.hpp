@@ -0,0 +1,188 @@
+// applying the sparse QR Householder sequence to sparse operands
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef SPARSE_RHS_Q_HPP
+#define SPARSE_RHS_Q_HPP
+
+#include <algorithm>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "householder_reach.hpp"
+#include "parallel_q.hpp"
+#include "sparse_qr_access.hpp"
+
+// Q * B (or Q' * B) for sparse B, with a sparse result.  Each column of B is
+// taken through HouseholderReach, so only the reflectors whose patterns meet
+// the column's growing pattern are applied - for a B with a handful of
+// nonzeros per column that is usually a small fraction of them.  If a column
+// fills in past denseFraction of the rows, or reaches more than that fraction
+// of the reflectors, tracking its pattern no longer pays, and the remaining
+// reflectors are applied to it directly.
+// The reach index is built once, so one object should serve many products.
+// Results keep the structural pattern, so entries that cancel numerically
+// are stored as explicit zeros.
+template<typename SparseQRType>
+struct SparseRhsHouseholderQ {
+    using Scalar = typename SparseQRType::Scalar;
+    using StorageIndex = typename SparseQRType::StorageIndex;
+    using SparseMatrixType = Eigen::SparseMatrix<Scalar, Eigen::ColMajor, StorageIndex>;
+    using SparseVectorType = Eigen::SparseVector<Scalar, Eigen::ColMajor, StorageIndex>;
+
+    explicit SparseRhsHouseholderQ(SparseQRType const & qr, double denseFraction = 0.1)
+        : qr_(qr), reach_(qr), denseLimit_(std::size_t(denseFraction * qr.rows())),
+          reflectorLimit_(std::size_t(denseFraction * (std::min)(qr.rows(), qr.cols()))),
+          x_(Eigen::Matrix<Scalar, Eigen::Dynamic, 1>::Zero(qr.rows())) {}
+
+    SparseMatrixType operator*(Eigen::Ref<SparseMatrixType const> const & other) {
+        return product(other, false);
+    }
+    // (a template, so sparse matrices do not convert to vectors)
+    template<int Options>
+    SparseVectorType operator*(Eigen::SparseVector<Scalar, Options, StorageIndex> const & other) {
+        return productVector(other, false);
+    }
+
+    // this is the adjoint, like SparseQR's matrixQ().transpose()
+    struct Transpose {
+        explicit Transpose(SparseRhsHouseholderQ & q) : q_(q) {}
+
+        SparseMatrixType operator*(Eigen::Ref<SparseMatrixType const> const & other) {
+            return q_.product(other, true);
+        }
+        template<int Options>
+        SparseVectorType operator*(Eigen::SparseVector<Scalar, Options, StorageIndex> const & other) {
+            return q_.productVector(other, true);
+        }
+    private:
+        SparseRhsHouseholderQ & q_;
+    };
+
+    Transpose transpose() { return Transpose(*this); }
+    Transpose adjoint() { return Transpose(*this); }
+
+    Eigen::Index rows() const { return qr_.rows(); }
+    Eigen::Index cols() const { return qr_.rows(); }
+
+private:
+    SparseMatrixType product(Eigen::Ref<SparseMatrixType const> const & other, bool transpose) {
+        using namespace Eigen;
+        eigen_assert(qr_.rows() == other.rows() && "Non conforming object sizes");
+        SparseMatrixType result(rows(), other.cols());
+        std::vector<StorageIndex> inner;
+        std::vector<Scalar> values;
+        for (Index j = 0; j < other.cols(); j++) {
+            rows_.clear();
+            for (typename Ref<SparseMatrixType const>::InnerIterator it(other, j); it; ++it) {
+                x_(it.row()) = it.value();
+                rows_.push_back(StorageIndex(it.row()));
+            }
+            applyColumn(transpose);
+            result.outerIndexPtr()[j] = StorageIndex(inner.size());
+            gather(inner, values);
+        }
+        result.outerIndexPtr()[other.cols()] = StorageIndex(inner.size());
+        result.resizeNonZeros(Index(inner.size()));
+        std::copy(inner.begin(), inner.end(), result.innerIndexPtr());
+        std::copy(values.begin(), values.end(), result.valuePtr());
+        return result;
+    }
+
+    template<int Options>
+    SparseVectorType productVector(Eigen::SparseVector<Scalar, Options, StorageIndex> const & other,
+                                   bool transpose) {
+        using namespace Eigen;
+        eigen_assert(qr_.rows() == other.size() && "Non conforming object sizes");
+        rows_.clear();
+        for (typename SparseVector<Scalar, Options, StorageIndex>::InnerIterator it(other); it; ++it) {
+            x_(it.index()) = it.value();
+            rows_.push_back(StorageIndex(it.index()));
+        }
+        applyColumn(transpose);
+        std::vector<StorageIndex> inner;
+        std::vector<Scalar> values;
+        gather(inner, values);
+        SparseVectorType result(rows());
+        result.resizeNonZeros(Index(inner.size()));
+        std::copy(inner.begin(), inner.end(), result.innerIndexPtr());
+        std::copy(values.begin(), values.end(), result.valuePtr());
+        return result;
+    }
+
+    // apply the sequence to x_, whose initial pattern is rows_, leaving the
+    // final pattern in rows_ (unordered), or setting dense_
+    void applyColumn(bool transpose) {
+        using namespace Eigen;
+        auto const & vecs   = HouseholderVectors(qr_);
+        auto const & hcoeff = HouseholderCoeffs(qr_);
+        Index const diagSize = (std::min)(qr_.rows(), qr_.cols());
+        dense_ = false;
+        Index switchAt = -1;
+        reach_.traverse(rows_.begin(), rows_.end(), 0, diagSize, transpose,
+                        [&](Index k) {
+                            if ((reach_.pattern().size() > denseLimit_) ||
+                                (reach_.candidates() > reflectorLimit_)) {
+                                switchAt = k;
+                                reach_.stop();
+                                return;
+                            }
+                            Scalar tau = vecs.col(k).dot(x_);
+                            if (tau == Scalar(0)) {
+                                return;
+                            }
+                            tau *= transpose ? hcoeff(k) : numext::conj(hcoeff(k));
+                            for (typename SparseQRType::QRMatrixType::InnerIterator it(vecs, k); it; ++it) {
+                                x_(it.row()) -= tau * it.value();
+                            }
+                        });
+        if (switchAt >= 0) {
+            // finish with every reflector from k on, in application order
+            dense_ = true;
+            if (transpose) {
+                ApplyHouseholderColumn(qr_, x_, switchAt, diagSize, true);
+            } else {
+                ApplyHouseholderColumn(qr_, x_, 0, switchAt + 1, false);
+            }
+        } else {
+            rows_.assign(reach_.pattern().begin(), reach_.pattern().end());
+        }
+    }
+
+    // append the column in x_ (in row order) and clear x_ for the next one
+    void gather(std::vector<StorageIndex> & inner, std::vector<Scalar> & values) {
+        using namespace Eigen;
+        if (dense_) {
+            for (Index i = 0; i < x_.size(); i++) {
+                if (x_(i) != Scalar(0)) {
+                    inner.push_back(StorageIndex(i));
+                    values.push_back(x_(i));
+                    x_(i) = Scalar(0);
+                }
+            }
+            return;
+        }
+        std::sort(rows_.begin(), rows_.end());
+        for (StorageIndex i : rows_) {
+            inner.push_back(i);
+            values.push_back(x_(i));
+            x_(i) = Scalar(0);
+        }
+    }
+
+    SparseQRType const &                  qr_;
+    HouseholderReach<SparseQRType>        reach_;
+    std::size_t                           denseLimit_;
+    std::size_t                           reflectorLimit_;
+    Eigen::Matrix<Scalar, Eigen::Dynamic, 1> x_;       // work vector, kept zero between columns
+    std::vector<StorageIndex>             rows_;
+    bool                                  dense_ = false;
+};
+
+#endif // SPARSE_RHS_Q_HPP
@@ -0,0 +1,279 @@
+// applying Q or Q' to dense matrices too large for memory, streamed through mapped files
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef STREAMING_Q_HPP
+#define STREAMING_Q_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseQR>
+
+#include "binary_io.hpp"
+#include "parallel_q.hpp"
+
+// A dense column-major matrix stored in a file in the layout of binary_io.hpp
+// (a header, then what WriteDense writes), mapped shared so columns can be
+// read and written in place.  Only the columns in use need be resident:
+// release() hands a range of them back to the kernel once done with.
+// valid() is false if the file could not be opened, created, or mapped, or
+// does not hold a dense matrix of this scalar type.
+template<typename Scalar>
+struct DenseFile {
+    // an existing file, read-only unless writable is set
+    explicit DenseFile(std::string const & path, bool writable = false) {
+        fd_ = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+        struct stat st;
+        if ((fd_ < 0) || (::fstat(fd_, &st) != 0) || (std::size_t(st.st_size) < dataOffset)) {
+            return;
+        }
+        if (map(st.st_size, writable)) {
+            BinaryReader in(base_, size_);
+            std::int64_t const * dims =
+                ReadBinaryHeader<Scalar, std::int64_t>(in, magic) ? in.take<std::int64_t>(2) : nullptr;
+            if (!dims || (size_ < dataOffset + PaddedSize(dims[0] * dims[1] * sizeof(Scalar)))) {
+                unmap();
+                return;
+            }
+            rows_ = dims[0];
+            cols_ = dims[1];
+        }
+    }
+
+    // a new (zero) rows x cols matrix, replacing any existing file
+    DenseFile(std::string const & path, Eigen::Index rows, Eigen::Index cols) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        std::size_t const size = dataOffset + PaddedSize(rows * cols * sizeof(Scalar));
+        if ((fd_ < 0) || (::ftruncate(fd_, size) != 0) || !map(size, true)) {
+            return;
+        }
+        BinaryHeader const header = MakeBinaryHeader<Scalar, std::int64_t>(magic);
+        std::int64_t const dims[2] = {rows, cols};
+        std::memcpy(base_, &header, sizeof(header));
+        std::memcpy(base_ + sizeof(header), dims, sizeof(dims));
+        rows_ = rows;
+        cols_ = cols;
+    }
+
+    DenseFile(DenseFile const &) = delete;
+    DenseFile & operator=(DenseFile const &) = delete;
+
+    ~DenseFile() {
+        unmap();
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    bool valid() const { return base_ != nullptr; }
+    Eigen::Index rows() const { return rows_; }
+    Eigen::Index cols() const { return cols_; }
+
+    Scalar * col(Eigen::Index j) const {
+        return reinterpret_cast<Scalar *>(base_ + dataOffset) + j * rows_;
+    }
+
+    // columns [first, first + count) as a matrix
+    Eigen::Map<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>>
+    cols(Eigen::Index first, Eigen::Index count) const {
+        return Eigen::Map<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>>(col(first), rows_, count);
+    }
+
+    // Drop columns [first, first + count) from this process's memory (changes
+    // stay in the page cache, to be written back).  Ranges are meant to be
+    // released in order: the page shared with the columns before the range goes
+    // too, as they are done with, but the one shared with the columns after it
+    // stays, to go with them.
+    void release(Eigen::Index first, Eigen::Index count) const {
+        std::uintptr_t const page = ::sysconf(_SC_PAGESIZE);
+        std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(col(first));
+        std::uintptr_t end = reinterpret_cast<std::uintptr_t>(col(first + count));
+        begin &= ~(page - 1);
+        // the last range takes the final, partial page as well
+        end = (first + count == cols_) ? ((end + page - 1) & ~(page - 1)) : (end & ~(page - 1));
+        if (begin < end) {
+            ::madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+        }
+    }
+
+    // write any changes through to storage, returning false on an I/O error
+    bool flush() const {
+        return ::msync(base_, size_, MS_SYNC) == 0;
+    }
+
+    // flush, then evict the whole file from the page cache as well, so the
+    // next pass reads it from storage
+    void dropCache() const {
+        flush();
+        ::madvise(base_, size_, MADV_DONTNEED);
+        ::posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+private:
+    static constexpr char const * magic = "QRDENSE";
+    static constexpr std::size_t dataOffset = sizeof(BinaryHeader) + 2 * sizeof(std::int64_t);
+
+    bool map(std::size_t size, bool writable) {
+        void * addr = ::mmap(nullptr, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                             MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        base_ = static_cast<char *>(addr);
+        size_ = size;
+        return true;
+    }
+
+    void unmap() {
+        if (base_) {
+            ::munmap(base_, size_);
+            base_ = nullptr;
+        }
+    }
+
+    int          fd_ = -1;
+    char *       base_ = nullptr;
+    std::size_t  size_ = 0;
+    Eigen::Index rows_ = 0, cols_ = 0;
+};
+
+// Q * B or Q' * B for a B held in a DenseFile, written to another, in chunks
+// of columns small enough that everything in flight fits a memory budget.
+// There are two chunk buffers: while one is multiplied, a helper thread
+// stores the previous result from the other and loads the next input into it,
+// so storage traffic overlaps the arithmetic.  Each chunk's mapped pages are
+// released as soon as they have been copied, so at most three chunks of
+// columns are resident at once - the two buffers and the one being copied.
+// The factorization itself is not counted against the budget.
+// The multiplication within a chunk is spread over nthreads threads (by
+// default Eigen::nbThreads() at the time of each call) as in parallel_q.hpp.
+template<typename SparseQRType>
+struct StreamingQ {
+    using Scalar = typename SparseQRType::Scalar;
+    using MatrixType = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>;
+
+    StreamingQ(SparseQRType const & qr, std::size_t memoryBudget, int nthreads = 0)
+        : qr_(qr), budget_(memoryBudget), nthreads_(nthreads) {}
+
+    // columns per chunk for the budget (at least one, whatever the budget)
+    Eigen::Index chunkColumns() const {
+        std::size_t const column = qr_.rows() * sizeof(Scalar);
+        return (std::max)(Eigen::Index(budget_ / (3 * column)), Eigen::Index(1));
+    }
+
+    // out = Q * in; creates out, replacing any existing file.  Returns false if
+    // a file cannot be opened or created, or sizes do not match.
+    bool apply(std::string const & in, std::string const & out) const { return stream(in, out, false); }
+
+    // out = Q' * in, the adjoint, as with SparseQR's matrixQ().transpose()
+    bool applyTranspose(std::string const & in, std::string const & out) const { return stream(in, out, true); }
+
+private:
+    bool stream(std::string const & inPath, std::string const & outPath, bool transpose) const {
+        using namespace Eigen;
+        DenseFile<Scalar> const in(inPath);
+        if (!in.valid() || (in.rows() != qr_.rows())) {
+            return false;
+        }
+        DenseFile<Scalar> const out(outPath, in.rows(), in.cols());
+        if (!out.valid()) {
+            return false;
+        }
+        Index const chunk = (std::min)(chunkColumns(), in.cols());
+        Index const chunks = chunk > 0 ? (in.cols() + chunk - 1) / chunk : 0;
+        auto first = [&](Index c) { return c * chunk; };
+        auto width = [&](Index c) { return (std::min)(chunk, in.cols() - c * chunk); };
+
+        MatrixType buffers[2] = {MatrixType(in.rows(), chunk), MatrixType(in.rows(), chunk)};
+        auto load = [&](Index c) {
+            buffers[c % 2].leftCols(width(c)) = in.cols(first(c), width(c));
+            in.release(first(c), width(c));
+        };
+        auto store = [&](Index c) {
+            out.cols(first(c), width(c)) = buffers[c % 2].leftCols(width(c));
+            out.release(first(c), width(c));
+        };
+
+        if (chunks > 0) {
+            load(0);
+        }
+        for (Index c = 0; c < chunks; c++) {
+            // the other buffer: finish with chunk c-1, then fill it with chunk c+1
+            std::future<void> io = std::async(std::launch::async, [&, c]() {
+                if (c > 0) {
+                    store(c - 1);
+                }
+                if (c + 1 < chunks) {
+                    load(c + 1);
+                }
+            });
+            multiply(buffers[c % 2].data(), in.rows(), width(c), transpose,
+                     std::integral_constant<bool, UsesHouseholderKernels<SparseQRType, decltype(buffers[0].col(0))>::value>());
+            io.get();
+        }
+        if (chunks > 0) {
+            store(chunks - 1);
+        }
+        return out.flush();
+    }
+
+    // apply Q or Q' in place to ncols contiguous columns, four at a time
+    void multiply(Scalar * x, Eigen::Index rows, Eigen::Index ncols, bool transpose, std::true_type) const {
+        using namespace Eigen;
+        Index const diagSize = (std::min)(qr_.rows(), qr_.cols());
+        Index const groups = (ncols + groupSize - 1) / groupSize;
+#ifdef _OPENMP
+        int const nthreads = nthreads_ > 0 ? nthreads_ : Eigen::nbThreads();
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+#endif
+        for (Index g = 0; g < groups; g++) {
+            Index const j = g * groupSize;
+            Index const width = numext::mini(Index(groupSize), ncols - j);
+            if (width == groupSize) {
+                ApplyHouseholderColumns<groupSize>(qr_, x + j * rows, rows, 0, diagSize, transpose);
+            } else {
+                for (Index c = j; c < j + width; c++) {
+                    ApplyHouseholderColumns<1>(qr_, x + c * rows, 0, 0, diagSize, transpose);
+                }
+            }
+        }
+    }
+
+    void multiply(Scalar * x, Eigen::Index rows, Eigen::Index ncols, bool transpose, std::false_type) const {
+        using namespace Eigen;
+        Index const diagSize = (std::min)(qr_.rows(), qr_.cols());
+        Map<MatrixType> chunk(x, rows, ncols);
+#ifdef _OPENMP
+        int const nthreads = nthreads_ > 0 ? nthreads_ : Eigen::nbThreads();
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 4)
+#endif
+        for (Index j = 0; j < ncols; j++) {
+            ApplyHouseholderColumn(qr_, chunk.col(j), 0, diagSize, transpose);
+        }
+    }
+
+    static constexpr int groupSize = 4;
+
+    SparseQRType const & qr_;
+    std::size_t          budget_;
+    int                  nthreads_;    // 0 for Eigen::nbThreads()
+};
+
+#endif // STREAMING_Q_HPP
@@ -5,200 +5,663 @@
 // This Source Code Form is subject to the terms of the Mozilla
 // Public License v. 2.0. If a copy of the MPL was not distributed
 // with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 #include <Eigen/Core>
 #include <Eigen/QR>
 #include <Eigen/SVD>
 #include <Eigen/SparseCore>
 #include <Eigen/SparseQR>
+#include <unsupported/Eigen/SparseExtra>
 
-#include <boost/iterator/counting_iterator.hpp>
-
+#include "blocked_q.hpp"
+#include "cmdline_options.hpp"
+#include "condition_estimate.hpp"
+#include "generate_q.hpp"
+#include "mixed_precision.hpp"
+#include "parallel_factorize.hpp"
+#include "parallel_q.hpp"
+#include "q_workspace.hpp"
+#include "qr_pattern.hpp"
+#include "qr_stats.hpp"
+#include "qr_update.hpp"
 #include "random_matrix.hpp"
+#include "sparse_rhs_q.hpp"
+#include "streaming_q.hpp"
 
-int main(int argc, char* argv[]) {
+using Float = double;
+using MatrixDF = Eigen::Matrix<Float, Eigen::Dynamic, Eigen::Dynamic>;
+
+// Every trial gets its own random engine, seeded from the run's seed and the
+// trial index, so any single trial can be rerun no matter how the trials were
+// divided among threads.
+std::default_random_engine
+TrialEngine(unsigned seed, long trial) {
+    std::seed_seq seq{seed, unsigned(trial), unsigned(trial >> 32)};
+    return std::default_random_engine(seq);
+}
+
+// How condition number estimates compared with exact (SVD) values, on the
+// trials where both were computed (and the matrix was not numerically singular)
+struct ConditionSample {
+    long   count = 0;
+    double minRatio = std::numeric_limits<double>::infinity();
+    double maxRatio = 0;
+    double logRatioSum = 0;
+
+    void add(double estimate, double exact) {
+        if (!std::isfinite(exact)) {
+            return;
+        }
+        double const ratio = estimate / exact;
+        count++;
+        minRatio = std::min(minRatio, ratio);
+        maxRatio = std::max(maxRatio, ratio);
+        logRatioSum += std::log(ratio);
+    }
+
+    void merge(ConditionSample const & other) {
+        count += other.count;
+        minRatio = std::min(minRatio, other.minRatio);
+        maxRatio = std::max(maxRatio, other.maxRatio);
+        logRatioSum += other.logRatioSum;
+    }
+};
+
+// The tolerances below were calibrated with the 2-norm condition number from
+// an SVD.  The estimates are of the 1-norm condition number of R, and can be
+// below that.  On ordinary matrices --exact-cond has measured estimate/exact
+// down to about 0.4 (over 30000 trials at six sizes and densities), so
+// estimates are scaled by this before use, which keeps the tolerances at
+// least as loose as the exact values would make them.
+constexpr double ConditionEstimateSlack = 3;
+
+// That does not hold for numerically singular matrices, where the estimate
+// can fall short of the exact value (above 1e15) by any factor: 0.008,
+// 0.0016 and 5e-20 have been seen.  No tolerance scaled by the condition
+// number means anything for them anyway, so the checks using one skip them.
+// They are easy to tell apart: in the same trials every singular matrix had
+// an estimate above 1e16, and no ordinary one came near 1e6.
+inline bool
+NumericallySingular(double conditionEstimate) {
+    return conditionEstimate * std::numeric_limits<double>::epsilon() >= 1e-2;
+}
+
+// Run one randomized test.  On failure returns a description, and sm holds the input matrix
+// Returns an empty string on success (including matrices rejected as unusable)
+// Condition numbers come from estimates on R, unless exactCondition is set,
+// in which case the SVD's are used and the estimates recorded against them
+std::string
+RunTrial(std::default_random_engine & gen, Eigen::Index size, float density,
+         Eigen::SparseMatrix<Float> & sm, bool exactCondition, ConditionSample & conditions) {
     using namespace Eigen;
+    std::ostringstream failure;
+    std::uniform_real_distribution<Float> unit(-1.0, 1.0);
+    auto randomMatrix = [&](Index rows, Index cols) {
+        return MatrixDF(MatrixDF::NullaryExpr(rows, cols, [&]() { return unit(gen); }));
+    };
 
-    if (argc < 3) {
-        std::cerr << "Usage: verify <Matrix-dimension> <density>\n";
-        return 1;
+    // test sparse QR by performing it on a random matrix and then doing a solve
+
+    // create a random sparse matrix of up to sizeXsize
+    // with no empty rows (SparseQR will not work!!)
+    sm = RandomMatrix<Float>(gen, size, density, NoEmptyRows);
+
+    // the pattern alone says which matrices are singular whatever their values.
+    // (SparseQR's rank cannot say so itself: it does not pivot for rank, and can
+    // count a pivot that has cancelled to rounding noise.)
+    MatrixStructure const structure = AnalyzeStructure(sm);
+
+    // Perform a sparse QR decomposition on it
+    using QRType = SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>>;
+    QRType qr(sm);
+
+    // Verify we can assign the result to a sparse matrix
+    SparseMatrix<Float> spQ; spQ = qr.matrixQ();
+
+    // now the dense version
+    MatrixDF dm(sm);
+    auto denseqr = dm.colPivHouseholderQr();
+
+    // an idea for an error threshold:
+    // use epsilon times the number of operands involved, roughly
+    // this is about 2e-5 for a 50x50 float matrix with 10% density
+    // actually that was too low so I tweaked it... hacky :(
+    // (count the actual nonzeros: filling empty rows makes small matrices denser than asked)
+    Float error_threshold = (20*sm.nonZeros())*std::numeric_limits<Float>::epsilon();
+
+    // verify that we can recover the original matrix with Q*R*P'
+    MatrixDF sprecover = qr.matrixQ() * (MatrixDF(qr.matrixR().template triangularView<Upper>()) * qr.colsPermutation().transpose());
+    if (((sprecover - MatrixDF(sm)).norm()/sprecover.norm()) > error_threshold) {
+        failure << "could not recover original sparse matrix (norm " << (sprecover - MatrixDF(sm)).norm() << " vs threshold " << error_threshold << ")";
+        return failure.str();
     }
 
-    Index const size = std::atoi(argv[1]);
-    float const density = std::atof(argv[2]);
+    // A factorization from a separately cached analysis must be identical, and for full
+    // rank the predicted factor sizes must be exact
+    QRType analyzed, reused;
+    QRSymbolic<QRType> symbolic = AnalyzeQR(analyzed, sm);
+    ReuseAnalysis(reused, symbolic);
+    reused.factorize(sm);
+    if ((MatrixDF(reused.matrixR()) != MatrixDF(qr.matrixR())) ||
+        (MatrixDF(HouseholderVectors(reused)) != MatrixDF(HouseholderVectors(qr)))) {
+        failure << "factorization reusing a cached analysis differs from compute()";
+        return failure.str();
+    }
+    if ((qr.rank() == qr.cols()) && (qr.rows() >= qr.cols()) &&
+        ((symbolic.nnzR != qr.matrixR().nonZeros()) ||
+         (symbolic.nnzQ != HouseholderVectors(qr).nonZeros()))) {
+        failure << "predicted factor sizes (" << symbolic.nnzR << ", " << symbolic.nnzQ
+                << ") differ from actual (" << qr.matrixR().nonZeros() << ", "
+                << HouseholderVectors(qr).nonZeros() << ")";
+        return failure.str();
+    }
+
+    // Factoring in parallel over the elimination tree must give exactly what compute() does,
+    // whatever the thread count (falling back to serial for one thread, or if the matrix needs it)
+    for (int threads : {1, 2, 3}) {
+        QRType parallel;
+        parallel.analyzePattern(sm);
+        ParallelFactorize(parallel, sm, threads);
+        if ((MatrixDF(parallel.matrixR()) != MatrixDF(qr.matrixR())) ||
+            (MatrixDF(HouseholderVectors(parallel)) != MatrixDF(HouseholderVectors(qr))) ||
+            (HouseholderCoeffs(parallel) != HouseholderCoeffs(qr)) ||
+            (parallel.colsPermutation().indices() != qr.colsPermutation().indices()) ||
+            (parallel.rank() != qr.rank())) {
+            failure << "parallel factorization with " << threads << " threads differs from compute()";
+            return failure.str();
+        }
+    }
+
+    // Perform a dense QR decomposition on the same matrix
+    // Try to recover with Q*R*P'
+    MatrixDF denseR = denseqr.matrixR().template triangularView<Upper>();
+    MatrixDF drecover = denseqr.matrixQ() * denseR * denseqr.colsPermutation().transpose();
+    if (((drecover - dm).norm()/drecover.norm()) > error_threshold) {
+        failure << "could not recover original dense matrix (norm " << (drecover - dm).norm() << " vs threshold " << error_threshold << ")";
+        return failure.str();
+    }
+
+    // the condition estimate for the full rank checks below
+    Float const condEstimate = (qr.rank() == qr.cols()) ? EstimateCondition(qr)
+                                                        : std::numeric_limits<Float>::infinity();
+
+    // try a solve
+    // (a structurally singular matrix cannot be full rank, so don't bother checking,
+    // and a numerically singular one has no meaningful tolerance)
+    if ((qr.rows() == qr.cols()) && (structure.structuralRank == qr.cols()) &&
+        (qr.rank() == qr.cols()) && !NumericallySingular(condEstimate)) {
+        // full rank -> invertible
+
+        // Create a random dense matrix that the sparse Q (and hopefully the dense Q) can be applied to
+        MatrixDF rhsmat = randomMatrix(qr.rows(), qr.cols());
 
-    using Float = double;
-
-    const int numTests = 1000000;
-    std::default_random_engine gen;
-
-    IOFormat OctaveFmt(StreamPrecision, 0, ", ", ";\n", "", "", "[", "]");
-    // let's test a bunch of matrices of different sizes
-    for (int t = 0; t < numTests; t++) {
-        // test sparse QR by performing it on a random matrix and then doing a solve
-
-        // create a random sparse matrix of up to sizeXsize
-        SparseMatrix<Float> sm = RandomMatrix<Float>(gen, size, density);
-
-        // reject if it contains empty rows (SparseQR will not work!!)
-        if (std::any_of(
-                boost::counting_iterator<int>(0),
-                boost::counting_iterator<int>(sm.rows()),
-                [&sm](int row) {
-                    // is this row absent in every column?
-                    return std::all_of(
-                        boost::counting_iterator<int>(0),
-                        boost::counting_iterator<int>(sm.cols()),
-                        [row,&sm](int col) {
-                            // determine if this row is absent in the given column
-                            bool found = false;
-                            // InnerIterator is a Java-style iterator :-/
-                            for (auto it = SparseMatrix<Float>::InnerIterator(sm, col); it; ++it) {
-                                if (it.row() == row) {
-                                    found = true;
-                                    break;
-                                }
-                            }
-                            return !found;
-                        });
-                })) {
-            continue;
-        }
-
-        // Perform a sparse QR decomposition on it
-        SparseQR<SparseMatrix<Float>, COLAMDOrdering<int>> qr(sm);
-        if (qr.rank() == 0) {
-            // this is just too degenerate to do anything with
-            continue;
-        }
-
-        // Verify we can assign the result to a sparse matrix
-        SparseMatrix<Float> spQ; spQ = qr.matrixQ();
-
-        // now the dense version
-        using MatrixDF = Matrix<Float, Dynamic, Dynamic>;
-        MatrixDF dm(sm);
-        auto denseqr = dm.colPivHouseholderQr();
-
-        // an idea for an error threshold:
-        // use epsilon times the number of operands involved, roughly
-        // this is about 2e-5 for a 50x50 float matrix with 10% density
-        // actually that was too low so I tweaked it... hacky :(
-        Float error_threshold = (20*sm.rows()*sm.cols()*density)*std::numeric_limits<Float>::epsilon();
-
-        // verify that we can recover the original matrix with Q*R*P'
-        MatrixDF sprecover = qr.matrixQ() * (MatrixDF(qr.matrixR().template triangularView<Upper>()) * qr.colsPermutation().transpose());
-        if (((sprecover - MatrixDF(sm)).norm()/sprecover.norm()) > error_threshold) {
-            std::cerr << "test " << t << ": could not recover original sparse matrix (norm " << (sprecover - MatrixDF(sm)).norm() << " vs threshold " << error_threshold << ")\n";
-            std::cerr << "dense result had " << denseqr.matrixQ().rows() << "x" << denseqr.matrixQ().cols() << " Q matrix\n";
-            std::cerr << "assigning " << qr.matrixQ().rows() << "x" << qr.matrixQ().cols() << " Q result to dense matrix\n";
-            MatrixDF q = qr.matrixQ();
-            std::cerr << "from Q =\n" << q.format(OctaveFmt) << "\n";
-            std::cerr << "and R =\n" << MatrixDF(qr.matrixR().template triangularView<Upper>()).format(OctaveFmt) << "\n";
-            std::cerr << "computed:\n" << sprecover.format(OctaveFmt) << "\n";
-            std::cerr << "vs:\n" << MatrixDF(sm).format(OctaveFmt) << "\n";
-            std::abort();
-        }
-
-        // Perform a dense QR decomposition on the same matrix
-        // Try to recover with Q*R*P'
-        MatrixDF denseR = denseqr.matrixR().template triangularView<Upper>();
-        MatrixDF drecover = denseqr.matrixQ() * denseR * denseqr.colsPermutation().transpose();
-        if (((drecover - dm).norm()/drecover.norm()) > error_threshold) {
-            std::cerr << "could not recover original dense matrix (norm " << (drecover - dm).norm() << " vs threshold " << error_threshold << ")\n";
-            std::cerr << "computed:\n" << drecover.format(OctaveFmt) << "\n";
-            std::cerr << "vs:\n" << dm.format(OctaveFmt) << "\n";
-            std::abort();
-        }
-
-        // try a solve
-        if ((qr.rows() == qr.cols()) && (qr.rank() == qr.cols())) {
-            // full rank -> invertible
-
-            // Create a random dense matrix that the sparse Q (and hopefully the dense Q) can be applied to
-            MatrixDF rhsmat = MatrixDF::Random(qr.rows(), qr.cols());
-
-            // solve vs. this new RHS
-            MatrixDF spresult = qr.solve(rhsmat);
-            MatrixDF dresult  = denseqr.solve(rhsmat);
-            // compare vs. dense result
-            // This source: http://people.eecs.berkeley.edu/~demmel/cs267/lecture21/lecture21.html
-            // suggests using the input's "condition number" to bound error checks
+        // solve vs. this new RHS
+        MatrixDF spresult = qr.solve(rhsmat);
+        MatrixDF dresult  = denseqr.solve(rhsmat);
+        // compare vs. dense result
+        // This source: http://people.eecs.berkeley.edu/~demmel/cs267/lecture21/lecture21.html
+        // suggests using the input's "condition number" to bound error checks
+        Float cond = condEstimate;
+        if (exactCondition) {
             JacobiSVD<MatrixXd> svd(dm);
-            Float cond = svd.singularValues()(0) / svd.singularValues()(svd.singularValues().size()-1);
-            Float solve_error_threshold = 2 * cond * std::numeric_limits<Float>::epsilon();
-            if (((spresult - dresult).norm()/spresult.norm()) > solve_error_threshold) {
-                std::cerr << "solve produced different results (norm ratio " << ((spresult - dresult).norm()/spresult.norm()) << " vs limit " << solve_error_threshold << ")\n";
-                std::cerr << "dense:\n" << dresult.format(OctaveFmt) << "\n";
-                std::cerr << "sparse:\n" << spresult.format(OctaveFmt) << "\n";
-                std::cerr << "for input matrix:\n" << dm.format(OctaveFmt) << "\n";
-                std::cerr << "and rhs:\n" << rhsmat.format(OctaveFmt) << "\n";
-                std::abort();
+            Float const exact = svd.singularValues()(0) / svd.singularValues()(svd.singularValues().size()-1);
+            conditions.add(cond, exact);
+            cond = exact;
+        } else {
+            cond *= ConditionEstimateSlack;
+        }
+        Float solve_error_threshold = 2 * cond * std::numeric_limits<Float>::epsilon();
+        if (((spresult - dresult).norm()/spresult.norm()) > solve_error_threshold) {
+            failure << "solve produced different results (norm ratio " << ((spresult - dresult).norm()/spresult.norm()) << " vs limit " << solve_error_threshold << ")";
+            return failure.str();
+        }
+
+        // factoring in float and refining in double must be as accurate, refinement stalls
+        // or not
+        MixedPrecisionQR<> mixedqr(sm);
+        MatrixDF mixedresult = mixedqr.solve(rhsmat);
+        if (((mixedresult - dresult).norm()/mixedresult.norm()) > solve_error_threshold) {
+            failure << "mixed precision solve differs from dense (norm ratio " << ((mixedresult - dresult).norm()/mixedresult.norm())
+                    << " vs limit " << solve_error_threshold << " after " << mixedqr.iterations() << " refinement steps"
+                    << (mixedqr.usesDoubleFactorization() ? ", with double fallback)" : ")");
+            return failure.str();
+        }
+    }
+
+    // least squares with the mixed precision solver, where refinement must handle the
+    // residual too: one right hand side far from the range of A, and one close to it
+    if ((qr.rows() > qr.cols()) && (structure.structuralRank == qr.cols()) && (qr.rank() == qr.cols())) {
+        Float const cond = condEstimate;
+        Float const eps = std::numeric_limits<Float>::epsilon();
+        MatrixDF const inRange = dm * randomMatrix(qr.cols(), 1);
+        MatrixDF const noise = randomMatrix(qr.rows(), 1);
+        std::pair<char const *, MatrixDF> const rhsCases[] = {
+            {"inconsistent", noise},
+            {"small residual", inRange + 1e-6 * inRange.norm() / noise.norm() * noise}};
+        for (auto const & rhsCase : rhsCases) {
+            MatrixDF const & rhs = rhsCase.second;
+            MatrixDF const expected = qr.solve(rhs);
+            MixedPrecisionQR<> mixedqr(sm);
+            MatrixDF const mixedresult = mixedqr.solve(rhs);
+            // least squares sensitivity: cond for the solution, cond^2 for the residual,
+            // over a floor for the rounding both solvers make even when A is perfectly
+            // conditioned (with n rows, sums and norms carry about sqrt(n) eps of it)
+            Float const residual = (rhs - dm * expected).norm() / (dm.norm() * expected.norm());
+            Float const threshold = 4 * (std::sqrt(Float(qr.rows())) + cond + cond * cond * residual) * eps;
+            Float const ratio = (mixedresult - expected).norm() / expected.norm();
+            if (ratio > threshold) {
+                failure << "mixed precision least squares (" << rhsCase.first << " right hand side) differs from SparseQR (norm ratio "
+                        << ratio << " vs limit " << threshold << " after " << mixedqr.iterations() << " refinement steps"
+                        << (mixedqr.usesDoubleFactorization() ? ", with double fallback)" : ")");
+                return failure.str();
+            }
+            // refinement contracts by about cond epsilon(float) per step, so a well conditioned
+            // matrix must never need the double factorization
+            if (mixedqr.usesDoubleFactorization() && (cond * std::numeric_limits<float>::epsilon() < 1e-3)) {
+                failure << "mixed precision least squares (" << rhsCase.first << " right hand side) fell back to double "
+                        << "on a well conditioned matrix (condition estimate " << cond << ")";
+                return failure.str();
             }
         }
+    }
+
+    // Verify that matrixQ() applied on the LHS of identity, and matrixQ assigned
+    // to a dense matrix, are the same
+    // We cannot simply compare the sparse and dense Q results because of pivoting
+    MatrixDF id = MatrixDF::Identity(qr.rows(), qr.rows());
+    MatrixDF q(qr.matrixQ());
+    MatrixDF q_times_id = qr.matrixQ() * id;
+    if ((q_times_id - q).norm() > error_threshold) {
+        failure << "matrixQ() * identity and matrixQ() converted to matrix differ (norm " << (q_times_id - q).norm() << ")";
+        return failure.str();
+    }
+    MatrixDF qt_times_id = qr.matrixQ().transpose() * id;
+    // this does not work :(
+    // MatrixDF qt(qr.matrixQ().transpose());
+    if ((qt_times_id - q.transpose()).norm() > error_threshold) {
+        failure << "matrixQ().transpose() * identity and transposed matrixQ(), converted to matrix, differ (norm " << (qt_times_id - q.transpose()).norm() << ")";
+        return failure.str();
+    }
+
+    // Q constructed directly in sparse form must match as well
+    MatrixDF sparse_q(SparseQ(qr.matrixQ()));
+    if ((sparse_q - q).norm() > error_threshold) {
+        failure << "directly constructed sparse Q and matrixQ() converted to matrix differ (norm " << (sparse_q - q).norm() << ")";
+        return failure.str();
+    }
+
+    // The blocked (compact WY) application of Q must match the one reflector at a time version
+    // Small panels ensure we exercise more than one of them
+    BlockedHouseholderQ<QRType> blockedQ(qr, 4);
+    MatrixDF rhs = randomMatrix(qr.rows(), qr.rows() / 2 + 1);
+    MatrixDF q_rhs = qr.matrixQ() * rhs;
+    MatrixDF blocked_q_rhs = blockedQ * rhs;
+    if ((blocked_q_rhs - q_rhs).norm() > error_threshold * rhs.norm()) {
+        failure << "blocked Q product differs from matrixQ() product (norm " << (blocked_q_rhs - q_rhs).norm() << ")";
+        return failure.str();
+    }
+    MatrixDF qt_rhs = qr.matrixQ().transpose() * rhs;
+    MatrixDF blocked_qt_rhs = blockedQ.transpose() * rhs;
+    if ((blocked_qt_rhs - qt_rhs).norm() > error_threshold * rhs.norm()) {
+        failure << "blocked Q' product differs from matrixQ().transpose() product (norm " << (blocked_qt_rhs - qt_rhs).norm() << ")";
+        return failure.str();
+    }
+
+    // Likewise for the column-parallel versions, including the identity shortcut
+    ParallelHouseholderQ<QRType> parallelQ(qr);
+    MatrixDF parallel_q_rhs = parallelQ * rhs;
+    MatrixDF parallel_qt_rhs = parallelQ.transpose() * rhs;
+    MatrixDF parallel_q_id = parallelQ * id;
+    if (((parallel_q_rhs - q_rhs).norm() > error_threshold * rhs.norm()) ||
+        ((parallel_qt_rhs - qt_rhs).norm() > error_threshold * rhs.norm()) ||
+        ((parallel_q_id - q).norm() > error_threshold)) {
+        failure << "parallel Q products differ from matrixQ() products";
+        return failure.str();
+    }
+
+    // Statistics must account for every reflector once per column, applied or skipped by
+    // the identity shortcut, and collecting them must not change the results
+    {
+        QRStats stats;
+        CollectQRStats collect(stats);
+        MatrixDF counted_q_id = parallelQ * MatrixDF::Identity(qr.rows(), qr.rows());
+        MatrixDF counted_qt_rhs = parallelQ.transpose() * rhs;
+        Index const diagSize = std::min(qr.rows(), qr.cols());
+        QRCounts const generation = stats.counts(QRPhase::QGeneration);
+        QRCounts const product = stats.counts(QRPhase::QProduct);
+        if (((counted_q_id - q).norm() > error_threshold) || (counted_qt_rhs != parallel_qt_rhs) ||
+            (generation.reflectorsApplied + generation.reflectorsSkipped != id.cols() * diagSize) ||
+            (product.reflectorsApplied != rhs.cols() * diagSize) || (product.reflectorsSkipped != 0) ||
+            (stats.calls(QRPhase::QGeneration) != 1) || (stats.calls(QRPhase::QProduct) != 1)) {
+            failure << "Q statistics do not account for every reflector (generation "
+                    << generation.reflectorsApplied << " applied, " << generation.reflectorsSkipped
+                    << " skipped; product " << product.reflectorsApplied << " applied)";
+            return failure.str();
+        }
+        // SparseQ's skips are exactly the identity shortcut's, with the rest of the
+        // reflectors either applied or not reaching the column
+        stats.reset();
+        SparseQ(qr.matrixQ());
+        QRCounts const sparse = stats.counts(QRPhase::QGeneration);
+        long long shortcut = 0;
+        for (Index j = 0; j < qr.rows(); j++) {
+            shortcut += diagSize - std::min(j + 1, diagSize);
+        }
+        if ((sparse.reflectorsSkipped != shortcut) ||
+            (sparse.reflectorsApplied + sparse.reflectorsSkipped + sparse.reflectorsUnreached != qr.rows() * diagSize)) {
+            failure << "sparse Q statistics do not account for every reflector (" << sparse.reflectorsApplied
+                    << " applied, " << sparse.reflectorsSkipped << " skipped of " << shortcut << ", "
+                    << sparse.reflectorsUnreached << " unreached)";
+            return failure.str();
+        }
+    }
+    InstrumentedQR<QRType> instrumented(sm);
+    if ((MatrixDF(instrumented.matrixR()) != MatrixDF(qr.matrixR())) ||
+        (instrumented.stats().calls(QRPhase::Ordering) != 1) ||
+        (instrumented.stats().calls(QRPhase::Factorization) != 1) ||
+        (instrumented.factorizationCounts().reflectorsApplied !=
+         instrumented.matrixR().nonZeros() - instrumented.rank())) {
+        failure << "instrumented factorization differs from compute(), or its statistics are wrong";
+        return failure.str();
+    }
+
+    // Each instruction set the kernels can use here must agree with the others, for
+    // single columns and for groups sharing index loads
+    for (int level = 0; level <= int(DetectSimdLevel()); level++) {
+        MatrixDF kernel_q_rhs = rhs, kernel_qt_rhs = rhs;
+        Index const diagSize = std::min(qr.rows(), qr.cols());
+        Index j = 0;
+        for (; j + 4 <= rhs.cols(); j += 4) {
+            ApplyHouseholderColumns<4>(qr, &kernel_q_rhs.coeffRef(0, j), rhs.rows(), 0, diagSize, false, SimdLevel(level));
+            ApplyHouseholderColumns<4>(qr, &kernel_qt_rhs.coeffRef(0, j), rhs.rows(), 0, diagSize, true, SimdLevel(level));
+        }
+        for (; j < rhs.cols(); j++) {
+            ApplyHouseholderColumns<1>(qr, &kernel_q_rhs.coeffRef(0, j), 0, 0, diagSize, false, SimdLevel(level));
+            ApplyHouseholderColumns<1>(qr, &kernel_qt_rhs.coeffRef(0, j), 0, 0, diagSize, true, SimdLevel(level));
+        }
+        if (((kernel_q_rhs - q_rhs).norm() > error_threshold * rhs.norm()) ||
+            ((kernel_qt_rhs - qt_rhs).norm() > error_threshold * rhs.norm())) {
+            failure << "Q products with the " << SimdLevelName(SimdLevel(level)) << " kernels differ from matrixQ() products";
+            return failure.str();
+        }
+    }
+
+    // Sparse right hand sides with a few nonzeros per column, both following the reach
+    // all the way and switching to dense application at once
+    SparseMatrix<Float> sparse_rhs = RandomMatrixOfSize<Float>(gen, qr.rows(), 4, 3.0f / qr.rows());
+    SparseVector<Float> sparse_rhs_vec = sparse_rhs.col(0);
+    MatrixDF dense_rhs(sparse_rhs);
+    for (double denseFraction : {1.0, 0.0}) {
+        SparseRhsHouseholderQ<QRType> sparseRhsQ(qr, denseFraction);
+        MatrixDF sparse_q_rhs(sparseRhsQ * sparse_rhs);
+        MatrixDF sparse_qt_rhs(sparseRhsQ.transpose() * sparse_rhs);
+        MatrixDF sparse_q_vec(sparseRhsQ * sparse_rhs_vec);
+        if (((sparse_q_rhs - q * dense_rhs).norm() > error_threshold * dense_rhs.norm()) ||
+            ((sparse_qt_rhs - q.transpose() * dense_rhs).norm() > error_threshold * dense_rhs.norm()) ||
+            ((sparse_q_vec - sparse_q_rhs.col(0)).norm() > error_threshold * dense_rhs.norm())) {
+            failure << "Q products with a sparse right hand side differ from dense ones (dense fraction "
+                    << denseFraction << ")";
+            return failure.str();
+        }
+    }
+
+    // ...and for the workspace versions writing into caller storage, including in place
+    QWorkspace<QRType> workspace(qr);
+    MatrixDF workspace_q_rhs(rhs.rows(), rhs.cols()), workspace_qt_rhs = rhs;
+    workspace.applyQ(rhs, workspace_q_rhs);
+    workspace.applyQt(workspace_qt_rhs, workspace_qt_rhs);
+    MatrixDF workspace_solve(qr.cols(), rhs.cols());
+    workspace.solve(rhs, workspace_solve);
+    MatrixDF eigen_solve = qr.solve(rhs);
+    if (((workspace_q_rhs - q_rhs).norm() > error_threshold * rhs.norm()) ||
+        ((workspace_qt_rhs - qt_rhs).norm() > error_threshold * rhs.norm()) ||
+        ((workspace_solve - eigen_solve).norm() > error_threshold * eigen_solve.norm())) {
+        failure << "workspace Q products or solve differ from SparseQR's";
+        return failure.str();
+    }
+
+    // ...and for streaming between files, with a budget of five columns per chunk so there
+    // are several chunks, and both groups of columns and single ones within them
+    std::string const streamPath = "/tmp/verify-stream-" + std::to_string(::getpid()) + "-" +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::string const streamIn = streamPath + "-in", streamOut = streamPath + "-out";
+    {
+        DenseFile<Float> in(streamIn, rhs.rows(), rhs.cols());
+        in.cols(0, rhs.cols()) = rhs;
+    }
+    StreamingQ<QRType> streaming(qr, 3 * 5 * qr.rows() * sizeof(Float));
+    MatrixDF streamed_q_rhs, streamed_qt_rhs;
+    if (streaming.apply(streamIn, streamOut)) {
+        streamed_q_rhs = DenseFile<Float>(streamOut).cols(0, rhs.cols());
+    }
+    if (streaming.applyTranspose(streamIn, streamOut)) {
+        streamed_qt_rhs = DenseFile<Float>(streamOut).cols(0, rhs.cols());
+    }
+    std::remove(streamIn.c_str());
+    std::remove(streamOut.c_str());
+    if ((streamed_q_rhs.cols() != rhs.cols()) || (streamed_qt_rhs.cols() != rhs.cols()) ||
+        ((streamed_q_rhs - q_rhs).norm() > error_threshold * rhs.norm()) ||
+        ((streamed_qt_rhs - qt_rhs).norm() > error_threshold * rhs.norm())) {
+        failure << "streamed Q products differ from matrixQ() products";
+        return failure.str();
+    }
 
-        // Verify that matrixQ() applied on the LHS of identity, and matrixQ assigned
-        // to a dense matrix, are the same
-        // We cannot simply compare the sparse and dense Q results because of pivoting
-        MatrixDF id = MatrixDF::Identity(qr.rows(), qr.rows());
-        MatrixDF q(qr.matrixQ());
-        MatrixDF q_times_id = qr.matrixQ() * id;
-        if ((q_times_id - q).norm() > error_threshold) {
-            std::cerr << "matrixQ() * identity and matrixQ() converted to matrix differ!\n";
-            std::cerr << "the former is:\n" << q_times_id.format(OctaveFmt) << "\nand the latter is:\n" << MatrixDF(q).format(OctaveFmt) << "\n";
-            std::cerr << "the original matrix was:\n" << dm.format(OctaveFmt) << "\n";
-            std::abort();
-        }
-        MatrixDF qt_times_id = qr.matrixQ().transpose() * id;
-        // this does not work :(
-        // MatrixDF qt(qr.matrixQ().transpose());
-        if ((qt_times_id - q.transpose()).norm() > error_threshold) {
-            std::cerr << "matrixQ().transpose() * identity and transposed matrixQ(), converted to matrix, differ!\n";
-            std::cerr << "the former is:\n" << qt_times_id.format(OctaveFmt) << "\nand the latter is:\n" << MatrixDF(q.transpose()).format(OctaveFmt) << "\n";
-            std::abort();
-        }
-
-        // Finally, check the operation of a "thin" Q, that is, applying it to a reduced identity
-        // in order to get the first k columns
-        if ((qr.cols() >= 2) && (q.cols() >= 2)) {
-            auto k = q.cols() / 2;
-            // two ways of forming the thin q
-            MatrixDF thin_q = qr.matrixQ() * MatrixDF::Identity(q.cols(), k);
-            if ((thin_q - q.leftCols(k)).norm() > error_threshold) {
-                std::cerr << "thin Q formed from applying Q=\n" << q.format(OctaveFmt);
-                std::cerr << "\nto " << k << " column identity gives wrong result:\n";
-                std::cerr << thin_q.format(OctaveFmt) << "\n";
-                std::abort();
+    // Rows appended to and removed from a factorization must leave factors of the new
+    // matrix, and its least squares solution.  An identity stacked below the input
+    // makes it tall and of full column rank, as updates require
+    {
+        Index const n = sm.cols();
+        std::vector<Triplet<Float>> triplets;
+        for (Index j = 0; j < n; j++) {
+            for (SparseMatrix<Float>::InnerIterator it(sm, j); it; ++it) {
+                triplets.emplace_back(it.row(), j, it.value());
+            }
+            triplets.emplace_back(sm.rows() + j, j, Float(1));
+        }
+        SparseMatrix<Float> tall(sm.rows() + n, n);
+        tall.setFromTriplets(triplets.begin(), triplets.end());
+        QRType tallqr(tall);
+        if (tallqr.rank() == n) {
+            QRUpdate<QRType> update(tallqr);
+            MatrixDF allRows(tall.rows() + 3, n);   // every row there has been, by row number
+            allRows.topRows(tall.rows()) = MatrixDF(tall);
+            for (int i = 0; i < 3; i++) {
+                SparseMatrix<Float, RowMajor> row = RandomMatrixOfSize<Float>(gen, 1, n, density);
+                Index id = update.appendRow(row.row(0));
+                allRows.row(id) = MatrixDF(row);
+                update.removeRow(update.rowIds()[gen() % update.rows()]);
+            }
+            MatrixDF current(update.rows(), n);
+            for (Index i = 0; i < update.rows(); i++) {
+                current.row(i) = allRows.row(update.rowIds()[i]);
             }
-            MatrixDF thin_q_2 = qr.matrixQ() * MatrixDF::Identity(q.cols(), q.cols()).leftCols(k);
-            if ((thin_q_2 - q.leftCols(k)).norm() > error_threshold) {
-                std::cerr << "thin Q formed from applying Q=\n" << q.format(OctaveFmt);
-                std::cerr << "\nto identity and taking the left " << k << " columns gives wrong result:\n";
-                std::cerr << thin_q.format(OctaveFmt) << "\n";
-                std::abort();
+            MatrixDF qr_recover = MatrixDF::Zero(update.extendedRows(), n);
+            qr_recover.topRows(n) = MatrixDF(update.matrixR());
+            update.applyQ(qr_recover);
+            MatrixDF ap = current * update.colsPermutation();
+            // (the input's threshold can be far too small for the stacked matrix)
+            Float update_threshold = 20 * update.rows() * n * std::numeric_limits<Float>::epsilon();
+            Float recover_error = 0;
+            for (Index i = 0; i < update.rows(); i++) {
+                recover_error = std::max(recover_error, (qr_recover.row(update.rowIds()[i]) - ap.row(i)).norm());
             }
-            // now the transpose cases
-            MatrixDF thin_q_t = qr.matrixQ().transpose() * MatrixDF::Identity(q.cols(), k);
-            if ((thin_q_t - q.transpose().leftCols(k)).norm() > error_threshold) {
-                std::cerr << "Q was " << q.format(OctaveFmt) << "\n";
-                std::cerr << "thin Q formed from applying Q'=\n" << MatrixDF(q.transpose()).format(OctaveFmt);
-                std::cerr << "\nto " << k << " column identity gives wrong result:\n";
-                std::cerr << thin_q_t.format(OctaveFmt) << "\n";
-                std::abort();
+            if (recover_error > update_threshold * ap.norm()) {
+                failure << "updated factors do not reproduce the updated matrix (error " << recover_error << ")";
+                return failure.str();
             }
-            MatrixDF thin_q_t_2 = qr.matrixQ().transpose() * MatrixDF::Identity(q.cols(), q.cols()).leftCols(k);
-            if ((thin_q_t_2 - q.transpose().leftCols(k)).norm() > error_threshold) {
-                std::cerr << "thin Q formed from applying Q'=\n" << MatrixDF(q.transpose()).format(OctaveFmt);
-                std::cerr << "\nto identity and taking the left " << k << " columns gives wrong result:\n";
-                std::cerr << thin_q_t_2.format(OctaveFmt) << "\n";
-                std::abort();
+            // (no tolerance scaled by the condition number means anything for a singular R)
+            Float cond = EstimateTriangularCondition(update.matrixR());
+            if (!NumericallySingular(cond)) {
+                if (exactCondition) {
+                    JacobiSVD<MatrixXd> svd(current);
+                    Float const exact = svd.singularValues()(0) / svd.singularValues()(n-1);
+                    conditions.add(cond, exact);
+                    cond = exact;
+                } else {
+                    cond *= ConditionEstimateSlack;
+                }
+                Matrix<Float, Dynamic, 1> b = current * Matrix<Float, Dynamic, 1>::NullaryExpr(n, [&]() { return unit(gen); });
+                Matrix<Float, Dynamic, 1> updateresult = update.solve(b);
+                Matrix<Float, Dynamic, 1> denseresult = current.colPivHouseholderQr().solve(b);
+                if ((updateresult - denseresult).norm() / denseresult.norm() > update_threshold * cond) {
+                    failure << "least squares solve with updated factors differs from dense (norm ratio "
+                            << (updateresult - denseresult).norm() / denseresult.norm() << ")";
+                    return failure.str();
+                }
             }
+        }
+    }
 
+    // Finally, check the operation of a "thin" Q, that is, applying it to a reduced identity
+    // in order to get the first k columns
+    if ((qr.cols() >= 2) && (q.cols() >= 2)) {
+        auto k = q.cols() / 2;
+        // two ways of forming the thin q
+        MatrixDF thin_q = qr.matrixQ() * MatrixDF::Identity(q.cols(), k);
+        if ((thin_q - q.leftCols(k)).norm() > error_threshold) {
+            failure << "thin Q formed from applying Q to " << k << " column identity gives wrong result";
+            return failure.str();
+        }
+        MatrixDF thin_q_2 = qr.matrixQ() * MatrixDF::Identity(q.cols(), q.cols()).leftCols(k);
+        if ((thin_q_2 - q.leftCols(k)).norm() > error_threshold) {
+            failure << "thin Q formed from applying Q to identity and taking the left " << k << " columns gives wrong result";
+            return failure.str();
+        }
+        // now the transpose cases
+        MatrixDF thin_q_t = qr.matrixQ().transpose() * MatrixDF::Identity(q.cols(), k);
+        if ((thin_q_t - q.transpose().leftCols(k)).norm() > error_threshold) {
+            failure << "thin Q formed from applying Q' to " << k << " column identity gives wrong result";
+            return failure.str();
+        }
+        MatrixDF thin_q_t_2 = qr.matrixQ().transpose() * MatrixDF::Identity(q.cols(), q.cols()).leftCols(k);
+        if ((thin_q_t_2 - q.transpose().leftCols(k)).norm() > error_threshold) {
+            failure << "thin Q formed from applying Q' to identity and taking the left " << k << " columns gives wrong result";
+            return failure.str();
+        }
+        // and the explicit thin Q API
+        MatrixDF thin_q_3 = ThinQ(qr.matrixQ(), k);
+        if ((thin_q_3 - q.leftCols(k)).norm() > error_threshold) {
+            failure << "thin Q formed by ThinQ with " << k << " columns gives wrong result";
+            return failure.str();
+        }
+        MatrixDF thin_q_t_3 = ThinQ(qr.matrixQ().transpose(), k);
+        if ((thin_q_t_3 - q.transpose().leftCols(k)).norm() > error_threshold) {
+            failure << "thin Q' formed by ThinQ with " << k << " columns gives wrong result";
+            return failure.str();
         }
     }
 
+    return "";
+}
+
+int main(int argc, char* argv[]) {
+    using namespace Eigen;
+
+    unsigned const threads = std::stoul(TakeOption(argc, argv, "--threads",
+                                                   std::to_string(std::max(1u, std::thread::hardware_concurrency()))));
+    unsigned const seed = std::stoul(TakeOption(argc, argv, "--seed", "0"));
+    long const numTests = std::stol(TakeOption(argc, argv, "--trials", "1000000"));
+    long const onlyTrial = std::stol(TakeOption(argc, argv, "--trial", "-1"));
+    long const exactCondEvery = std::stol(TakeOption(argc, argv, "--exact-cond", "0"));
+
+    if (argc < 3) {
+        std::cerr << "Usage: verify <Matrix-dimension> <density> [--threads=N] [--seed=S] [--trials=N] [--trial=T] [--exact-cond=K]\n";
+        std::cerr << "       --trial reruns just one (seed, trial) pair, e.g. to reproduce a failure\n";
+        std::cerr << "       --exact-cond uses exact (SVD) condition numbers on every Kth trial, and reports\n";
+        std::cerr << "       how the cheaper estimates used otherwise compare with them\n";
+        return 1;
+    }
+
+    Index const size = std::atoi(argv[1]);
+    float const density = std::atof(argv[2]);
+
+    // one trial per thread already keeps the machine busy
+    if (threads > 1) {
+        Eigen::setNbThreads(1);
+    }
+    Eigen::initParallel();
+
+    // trials are handed out dynamically; each worker stops at the first failure seen by any
+    std::atomic<long> nextTrial(onlyTrial >= 0 ? onlyTrial : 0);
+    long const endTrial = onlyTrial >= 0 ? onlyTrial + 1 : numTests;
+    std::atomic<bool> failed(false);
+    std::mutex failureMutex;
+    long failedTrial = -1;
+    std::string failureMessage;
+    SparseMatrix<Float> failedMatrix;
+
+    std::vector<long>   trialsRun(threads, 0);
+    std::vector<double> secondsTaken(threads, 0);
+    std::vector<ConditionSample> conditions(threads);
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < threads; w++) {
+        workers.emplace_back([&, w]() {
+            auto start = std::chrono::steady_clock::now();
+            SparseMatrix<Float> sm;
+            long t;
+            while (!failed && ((t = nextTrial++) < endTrial)) {
+                std::default_random_engine gen = TrialEngine(seed, t);
+                bool const exactCondition = (exactCondEvery > 0) && (t % exactCondEvery == 0);
+                std::string result = RunTrial(gen, size, density, sm, exactCondition, conditions[w]);
+                trialsRun[w]++;
+                if (!result.empty()) {
+                    std::lock_guard<std::mutex> lock(failureMutex);
+                    // keep the lowest failing trial, in case several threads fail at once
+                    if ((failedTrial < 0) || (t < failedTrial)) {
+                        failedTrial = t;
+                        failureMessage = result;
+                        failedMatrix = sm;
+                    }
+                    failed = true;
+                }
+            }
+            secondsTaken[w] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        });
+    }
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    long totalTrials = 0;
+    double totalRate = 0;
+    for (unsigned w = 0; w < threads; w++) {
+        double rate = secondsTaken[w] > 0 ? trialsRun[w] / secondsTaken[w] : 0;
+        std::cout << "thread " << w << ": " << trialsRun[w] << " trials, " << rate << " trials/sec\n";
+        totalTrials += trialsRun[w];
+        totalRate += rate;
+    }
+    std::cout << "total: " << totalTrials << " trials, " << totalRate << " trials/sec\n";
+
+    ConditionSample allConditions;
+    for (auto const & c : conditions) {
+        allConditions.merge(c);
+    }
+    if (allConditions.count > 0) {
+        std::cout << "condition estimate / exact over " << allConditions.count << " samples: min "
+                  << allConditions.minRatio << ", max " << allConditions.maxRatio << ", geometric mean "
+                  << std::exp(allConditions.logRatioSum / allConditions.count) << "\n";
+    }
+
+    if (failedTrial >= 0) {
+        std::string const reproducer = "verify-fail-" + std::to_string(seed) + "-" + std::to_string(failedTrial) + ".mtx";
+        saveMarket(failedMatrix, reproducer);
+        std::cerr << "seed " << seed << " trial " << failedTrial << ": " << failureMessage << "\n";
+        std::cerr << "input matrix written to " << reproducer << "; rerun with --seed=" << seed << " --trial=" << failedTrial << "\n";
+        return 1;
+    }
+
     return 0;
 
 }
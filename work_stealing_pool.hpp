@@ -0,0 +1,89 @@
+// a minimal work-stealing task pool
+//
+// Copyright (C) 2018 Jeffrey E. Trull <edaskel@att.net>
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef WORK_STEALING_POOL_HPP
+#define WORK_STEALING_POOL_HPP
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Tasks are dealt out among the threads' queues.  Each thread takes work
+// from the back of its own queue and, when that is empty, steals from the
+// front of another's, so threads that finish early take over the work of
+// those that do not.  run() returns once every task has finished.
+// The queues are plain locked deques: tasks here are coarse enough that
+// contention on them is not what limits scaling.
+// No task is queued after run() starts, so a thread that finds every queue
+// empty can never get more work.  It finishes then, rather than waiting for
+// the tasks still running elsewhere, and run() joins it with the rest.
+template<typename Task>
+struct WorkStealingPool {
+    explicit WorkStealingPool(int nthreads) : queues_((std::max)(nthreads, 1)) {}
+
+    int threads() const { return int(queues_.size()); }
+
+    // run body(task, thread) on every task, using all the pool's threads (the
+    // calling one is thread 0)
+    template<typename Body>
+    void run(std::vector<Task> const & tasks, Body body) {
+        int const nthreads = threads();
+        for (std::size_t i = 0; i < tasks.size(); i++) {
+            queues_[i % nthreads].tasks.push_back(tasks[i]);
+        }
+        auto work = [&](int id) {
+            Task t;
+            while (take(id, t)) {
+                body(t, id);
+            }
+        };
+        std::vector<std::thread> helpers;
+        for (int id = 1; id < nthreads; id++) {
+            helpers.emplace_back(work, id);
+        }
+        work(0);
+        for (auto & h : helpers) {
+            h.join();
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex      mutex;
+        std::deque<Task> tasks;
+    };
+
+    // our own newest task, or else the oldest one of the first other thread that has any
+    bool take(int id, Task & t) {
+        {
+            Queue & q = queues_[id];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                t = q.tasks.back();
+                q.tasks.pop_back();
+                return true;
+            }
+        }
+        for (int i = 1; i < threads(); i++) {
+            Queue & q = queues_[(id + i) % threads()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                t = q.tasks.front();
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<Queue> queues_;
+};
+
+#endif // WORK_STEALING_POOL_HPP